@@ -0,0 +1,370 @@
+/* extrace-bench - exec() storm generator and event loss benchmark
+ *
+ * Usage: extrace-bench [-del] [-n N] [-r RATE] [-w WIDTH] [-D DEPTH]
+ *                      [-a BYTES] [-s BYTES] [-c KIND] [-W FILE] fan|chain
+ * fan      run N short-lived true(1), up to WIDTH at once
+ * chain    run chains of DEPTH processes, each forks the next and execs
+ * -n N     number of exec() (default 10000)
+ * -r RATE  start at most RATE exec() per second (default: as fast as possible)
+ * -w WIDTH concurrent processes for fan (default 64)
+ * -D DEPTH length of the chains (default 64)
+ * -a BYTES add an argument of BYTES bytes
+ * -s BYTES add an environment variable of BYTES bytes
+ * -c KIND  arguments: plain (default), quote (shell metacharacters and
+ *          control characters), cc (long compiler command lines) or utf8
+ * -W FILE  save a capture of the trace to FILE, as extrace -W
+ * -d -e -l fetch cwd, environment and path, as for extrace(1)
+ *
+ * The workload runs in a child traced with libextrace.  Each exec()
+ * carries a unique token in argv[1], so the events can be matched
+ * against what was launched; reported are the lost exec(), the lag from
+ * execve(2) to the callback, and the CPU time of the tracer per exec().
+ * Needs the privileges of extrace(1).
+ *
+ * A capture of a -c corpus measures the output formatting without the
+ * kernel: extrace -R FILE -o /dev/null [-O FMT] reports the time spent
+ * formatting each exec() into memory, apart from writing it.
+ *
+ * Copyright (c) 2014-2016, 2023 Leah Neukirchen <leah@vuxu.org>
+ * Copyright (c) 2017 Duncan Overbruck <mail@duncano.de>
+ */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "extrace.h"
+
+#define TRUE_PATH "/usr/bin/true"
+#define TOKEN "extrace-bench:"
+#define PAD_MAX (1 << 20)	/* bytes, more would fail exec() anyway */
+
+static unsigned long nexec = 10000;
+static unsigned long rate;
+static int width = 64;
+static int depth = 64;
+
+/* shared with the workload: when each exec() was started.  */
+static uint64_t *launched;
+
+static unsigned char *seen;
+static unsigned long traced, dups, other;
+static struct extrace_hist lag;
+
+static char token[64];
+static char **args;
+static char *envs[2];
+
+static const char *quote_args[] = {
+	"it's", "a b  c", "$HOME", "\"quoted\"", "back\\slash", "tab\there",
+	"new\nline", "*.[ch]", "a;b&c|d", "`id`", "$(id)", "~user", "x=y",
+	"\001ctl\177", "{a,b}", "#comment", "!bang", "<in>out", "%s%n", 0
+};
+
+static const char *utf8_args[] = {
+	"Gr\303\274\303\237e", "na\303\257ve caf\303\251",
+	"\346\227\245\346\234\254\350\252\236.txt",
+	"\316\225\316\273\316\273\316\267\316\275\316\271\316\272\316\254",
+	"\360\237\232\200 launch", "\320\277\321\200\320\270\320\262\320\265\321\202",
+	"mixed \303\244 'quote'", 0
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+run(unsigned long seq)
+{
+	snprintf(token, sizeof token, TOKEN "%lu", seq);
+	launched[seq] = now_ns();
+	execve(TRUE_PATH, args, envs);
+	_exit(127);
+}
+
+/* sleep until exec() number i is due.  */
+static void
+pace(uint64_t start, unsigned long i)
+{
+	uint64_t due, now;
+	struct timespec ts;
+
+	if (!rate)
+		return;
+	due = start + i * 1000000000 / rate;
+	if ((now = now_ns()) >= due)
+		return;
+	ts.tv_sec = (due - now) / 1000000000;
+	ts.tv_nsec = (due - now) % 1000000000;
+	nanosleep(&ts, 0);
+}
+
+static void
+fan(void)
+{
+	uint64_t start = now_ns();
+	unsigned long i;
+	int live = 0;
+
+	for (i = 0; i < nexec; i++) {
+		pace(start, i);
+		for (; live >= width; live--)
+			wait(0);
+		switch (fork()) {
+		case -1: err(1, "fork");
+		case 0: run(i);
+		}
+		live++;
+	}
+	while (wait(0) > 0)
+		;
+}
+
+/* each process forks the rest of the chain, then execs itself.  */
+static void
+chain(void)
+{
+	uint64_t start = now_ns();
+	unsigned long i, j, n;
+	pid_t pid;
+
+	for (i = 0; i < nexec; i += depth) {
+		pace(start, i);
+		n = nexec - i < (unsigned long)depth ? nexec - i : (unsigned long)depth;
+		if ((pid = fork()) == -1)
+			err(1, "fork");
+		if (pid == 0) {
+			for (j = 0; j + 1 < n; j++)
+				if (fork() != 0)
+					break;
+			run(i + j);
+		}
+		waitpid(pid, 0, 0);
+	}
+}
+
+static void
+event(struct exec_event *ev, void *arg)
+{
+	unsigned long seq;
+	char *end;
+
+	(void)arg;
+	if (ev->argc < 2 || strncmp(ev->argv[1], TOKEN, strlen(TOKEN)) != 0) {
+		other++;
+		return;
+	}
+	seq = strtoul(ev->argv[1] + strlen(TOKEN), &end, 10);
+	if (*end || seq >= nexec) {
+		other++;
+		return;
+	}
+	if (seen[seq]++) {
+		dups++;
+		return;
+	}
+	traced++;
+	extrace_hist_add(&lag, now_ns() - launched[seq]);
+}
+
+/* argv: true, the token, the corpus, padding.  */
+static void
+make_args(const char *kind, const char *padding)
+{
+	static char buf[64];
+	const char **v = 0;
+	int i, n = 0, cc = strcmp(kind, "cc") == 0;
+
+	if (strcmp(kind, "quote") == 0)
+		v = quote_args;
+	else if (strcmp(kind, "utf8") == 0)
+		v = utf8_args;
+	else if (!cc && strcmp(kind, "plain") != 0)
+		errx(1, "unknown corpus: %s", kind);
+
+	if (!(args = calloc(100, sizeof *args)))
+		err(1, "calloc");
+	args[n++] = (char *)"true";
+	args[n++] = token;
+	for (i = 0; v && v[i]; i++)
+		args[n++] = (char *)v[i];
+	if (cc) {
+		/* like a large C++ build: many -I and -D.  */
+		args[n++] = (char *)"-c";
+		args[n++] = (char *)"-O2";
+		args[n++] = (char *)"-pipe";
+		args[n++] = (char *)"-fPIC";
+		for (i = 0; i < 40; i++) {
+			snprintf(buf, sizeof buf, "-I/usr/local/include/pkg%02d/src", i);
+			args[n++] = strdup(buf);
+		}
+		for (i = 0; i < 30; i++) {
+			snprintf(buf, sizeof buf, "-DHAVE_FEATURE_%02d=1", i);
+			args[n++] = strdup(buf);
+		}
+		args[n++] = (char *)"-o";
+		args[n++] = (char *)"obj/module/file_with_long_name.o";
+		args[n++] = (char *)"src/module/file_with_long_name.cpp";
+	}
+	if (padding)
+		args[n++] = (char *)padding;
+	args[n] = 0;
+}
+
+static char *
+pad(const char *prefix, size_t n)
+{
+	size_t len = strlen(prefix);
+	char *s;
+
+	if (!(s = malloc(len + n + 1)))
+		err(1, "malloc");
+	memcpy(s, prefix, len);
+	memset(s + len, 'x', n);
+	s[len + n] = 0;
+	return s;
+}
+
+/* parse a decimal number from min to max, or exit.  */
+static unsigned long
+number(const char *s, unsigned long min, unsigned long max)
+{
+	unsigned long n;
+	char *end;
+
+	errno = 0;
+	n = strtoul(s, &end, 10);
+	if (!isdigit((unsigned char)*s) || *end || errno || n < min || n > max)
+		errx(1, "invalid number: %s", s);
+	return n;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct extrace *x;
+	struct rusage ru;
+	const char *kind = "plain", *capfile = 0;
+	char *padding = 0;
+	FILE *capture = 0;
+	uint64_t t0, t1;
+	double cpu;
+	int flags = 0;
+	int opt, fd[2], status, idle, n;
+	pid_t gen;
+	void (*workload)(void);
+
+	while ((opt = getopt(argc, argv, "a:c:dD:eln:r:s:w:W:")) != -1)
+		switch (opt) {
+		case 'a': padding = pad("", number(optarg, 0, PAD_MAX)); break;
+		case 'c': kind = optarg; break;
+		case 'd': flags |= EXTRACE_CWD; break;
+		case 'D': depth = number(optarg, 1, INT_MAX); break;
+		case 'e': flags |= EXTRACE_ENV; break;
+		case 'l': flags |= EXTRACE_PATH; break;
+		case 'n':
+			nexec = number(optarg, 1, SIZE_MAX / sizeof *launched);
+			break;
+		case 'r': rate = number(optarg, 0, ULONG_MAX); break;
+		case 's': envs[0] = pad("PAD=", number(optarg, 0, PAD_MAX)); break;
+		case 'w': width = number(optarg, 1, INT_MAX); break;
+		case 'W': capfile = optarg; break;
+		default: goto usage;
+		}
+	if (optind + 1 != argc)
+		goto usage;
+	if (strcmp(argv[optind], "fan") == 0)
+		workload = fan;
+	else if (strcmp(argv[optind], "chain") == 0)
+		workload = chain;
+	else {
+usage:
+		fprintf(stderr, "Usage: extrace-bench [-del] [-n N] [-r RATE] [-w WIDTH] [-D DEPTH]\n"
+		    "                    [-a BYTES] [-s BYTES] [-c KIND] [-W FILE] fan|chain\n");
+		exit(1);
+	}
+
+	make_args(kind, padding);
+	launched = mmap(0, nexec * sizeof *launched, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANON, -1, 0);
+	if (launched == MAP_FAILED)
+		err(1, "mmap");
+	if (!(seen = calloc(nexec, 1)))
+		err(1, "calloc");
+	if (!(x = extrace_open(flags, event, 0)))
+		err(1, "extrace_open");
+	if (capfile && (!(capture = fopen(capfile, "w")) ||
+	    extrace_record(x, capture) == -1))
+		err(1, "%s", capfile);
+
+	/* the workload waits until it is traced.  */
+	if (pipe(fd) == -1)
+		err(1, "pipe");
+	switch ((gen = fork())) {
+	case -1: err(1, "fork");
+	case 0:
+		close(fd[1]);
+		if (read(fd[0], &opt, 1) != 1)
+			_exit(1);
+		workload();
+		_exit(0);
+	}
+	close(fd[0]);
+	if (extrace_trace(x, gen) == -1)
+		err(1, "extrace_trace");
+	t0 = now_ns();
+	if (write(fd[1], "", 1) != 1)
+		err(1, "write");
+	close(fd[1]);
+
+	/* follow until the workload is done and the tracer is idle.  */
+	for (t1 = 0, idle = 0; idle < 10; )
+		if ((n = extrace_dispatch(x, 100)) == -1) {
+			err(1, "extrace_dispatch");
+		} else if (n > 0) {
+			idle = 0;
+		} else if (t1 || waitpid(gen, &status, WNOHANG) == gen) {
+			if (!t1)
+				t1 = now_ns();
+			idle++;
+		}
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		errx(1, "workload failed");
+
+	getrusage(RUSAGE_SELF, &ru);
+	cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	printf("%s: %lu execs in %.3fs (%.0f/s), %lu traced, %lu lost (%.2f%%), "
+	    "%lu duplicate, %lu other\n", argv[optind], nexec, (t1 - t0) / 1e9,
+	    nexec / ((t1 - t0) / 1e9), traced, nexec - traced,
+	    100.0 * (nexec - traced) / nexec, dups, other);
+	if (lag.n)
+		printf("lag: mean=%.1fus p50=%.1fus p90=%.1fus p99=%.1fus "
+		    "max=%.1fus\n", lag.sum / 1e3 / lag.n,
+		    extrace_hist_pct(&lag, 0.5) / 1e3,
+		    extrace_hist_pct(&lag, 0.9) / 1e3,
+		    extrace_hist_pct(&lag, 0.99) / 1e3, lag.max / 1e3);
+	printf("tracer cpu: %.3fs, %.1fus per traced exec\n", cpu,
+	    traced ? cpu * 1e6 / traced : 0.0);
+
+	extrace_close(x);
+	if (capture && fclose(capture) == EOF)
+		err(1, "%s", capfile);
+	return nexec != traced;
+}
@@ -1,291 +1,3599 @@
 /* extrace - trace exec() calls system-wide
  *
- * Usage: extrace [-deflq] [-o FILE] [-p PID|CMD...]
+ * Usage: extrace [-AdeEfIlPqz] [-b POL] [-c METH] [-C FILE] [-F EXPR] [-O FORMAT]
+ *                [-S SOCK] [-T FILE] [-K NAME]... [-L LIM]... [-n N]
+ *                [-M NAME | -o FILE [-m SIZE] [-s SIZE] [-t SECS]]
+ *                [-R FILE | -W FILE] [-x PID]... [-p PID... | CMD...]
+ *        extrace [-fIq] [-O FORMAT] [-o FILE] -r FILE
  * default: show all exec(), globally
- * -p PID   only show exec() descendant of PID
+ * -p PID   only show exec() descendant of PID, may be repeated
+ * -x PID   don't show exec() descendant of PID, may be repeated
  * CMD...   run CMD... and only show exec() descendant of it
  * -o FILE  log to FILE instead of standard output
+ * -m SIZE  keep the last SIZE bytes of binary records in FILE, a mapped ring
+ * -M NAME  publish binary records in shared memory ring NAME (of -m SIZE)
+ * -s SIZE  rotate FILE to FILE.N after SIZE bytes
+ * -t SECS  rotate FILE to FILE.N every SECS seconds
+ * -z       gzip rotated segments in the background
+ * -c METH  compress output with zstd or lz4 (default by .zst/.lz4 suffix)
+ * -b POL   when the compressor falls behind, block (default) or drop
+ * -S SOCK  serve records to any number of subscribers on Unix socket SOCK
+ * -L LIM   show at most RATE exec() per second, in bursts of up to BURST,
+ *          LIM is [uid:|comm:]RATE[/BURST] to limit each uid or command;
+ *          suppressed exec() are summarized on stderr, may be repeated
+ * -n N     only show every N-th exec()
+ * -T FILE  tag exec() whose argv or env contains a pattern from FILE
+ * -A       also show exec() of our own pipeline (process group); by default
+ *          it is excluded when standard input or output is a pipe
+ * -W FILE  also save kernel events and what was read for them to FILE
+ * -R FILE  replay the events saved with -W FILE instead of tracing, as fast
+ *          as possible, and report the timings
+ * -O FMT   output format: text (default), bin, json, or chrome for a
+ *          timeline of the processes in Chrome trace event format, or
+ *          folded for stacks of programs weighted by their run time, or
+ *          compdb for a compile_commands.json of the compilers run
+ * -K NAME  also take NAME, e.g. a compiler wrapper, as compiler for compdb,
+ *          may be repeated
+ * -r FILE  decode binary records from FILE (- for stdin) instead of tracing,
+ *          or follow the shared memory ring NAME given as shm:NAME
  * -d       print cwd of process
  * -e       print environment of process
+ * -E       print changes to the environment of the nearest traced ancestor
  * -f       flat output: no indentation
+ * -F EXPR  only show exec() matching EXPR, e.g. 'uid=0 and not comm=sh'
+ * -I       intern repeated argv[0], cwd and environments (bin and json)
  * -l       print full path of argv[0]
+ * -P       at exit, print the critical path, the time per program and
+ *          the average parallelism of the traced processes
+ * -C FILE  write the average number of live processes and of running
+ *          programs in each 10ms to FILE, and at exit, how long each
+ *          number of programs ran at once
  * -q       don't print exec() arguments
  *
+ * Invoked as extrace-decode, behaves like extrace -r.
+ *
  * Copyright (c) 2014-2016, 2023 Leah Neukirchen <leah@vuxu.org>
  * Copyright (c) 2017 Duncan Overbruck <mail@duncano.de>
  */
 #include <sys/types.h>
 #include <sys/event.h>
+#include <sys/mman.h>
 #include <sys/param.h>
-#include <sys/proc.h>
-#include <sys/sysctl.h>
-#include <sys/user.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
-#include <fcntl.h>
-#include <err.h>
-#include <kvm.h>
-#include <signal.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <err.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "extrace.h"
+#include "extrace_ring.h"
+
+/* growable byte buffer, records are formatted into one before output.  */
+struct buf {
+	char *s;
+	size_t len;
+	size_t cap;
+};
+
+/*
+ * Binary format: the magic, then records of
+ *   varint length of the rest, byte type, varint flags, varint time,
+ *   varint pid, varint ppid, varint depth+1,
+ *   [string cwd], [string path], strings argv, [strings envp],
+ *   [strings unset], [strings tags]
+ * where string is varint length+1 and bytes (length 0 encodes NULL),
+ * and strings is varint count+1 followed by that many strings.
+ * With REC_INTERN, cwd, path and envp are varint id+1 (0 encodes NULL)
+ * of an earlier definition record, and argv is the id of argv[0]
+ * followed by strings for the rest.  Definitions are
+ *   varint length of the rest, byte type, varint id, byte kind,
+ *   string (INTERN_STR) or strings (INTERN_ENV)
+ * and replace any earlier definition of the same id.
+ * All varints are unsigned LEB128.
+ */
+#define BIN_MAGIC "EXTRACE\001"
+#define REC_EXEC 1
+#define REC_DEF  2
+
+#define REC_CWD    EXTRACE_CWD	/* cwd field present */
+#define REC_PATH   EXTRACE_PATH	/* path field present */
+#define REC_ENV    EXTRACE_ENV	/* envp field present */
+#define REC_INTERN 0x08	/* strings are references to definitions */
+#define REC_ENVDIFF EXTRACE_ENVDIFF	/* envp only has changes, unset field present */
+#define REC_TAGS   EXTRACE_TAGS	/* tags field present */
+
+/* default size of the -M ring.  */
+#define SHM_RING_SIZE (16 << 20)
+
+#define SUPPRESS_INTERVAL 10	/* seconds between -L summaries */
+
+/* dump counters and stage timings, SIGINFO is ^T on BSD terminals.  */
+#ifdef SIGINFO
+#define SIGSTATS SIGINFO
+#else
+#define SIGSTATS SIGUSR1
+#endif
+
+/* interned strings, evicted least recently used first.  */
+#define INTERN_MAX   4096
+#define INTERN_BYTES (8 << 20)
+
+enum { INTERN_STR, INTERN_ENV };
+
+struct istr {
+	uint32_t hash;
+	int kind;
+	size_t len;
+	char *data;
+	struct istr *hnext;	/* hash chain, or free list */
+	struct istr *prev;	/* LRU list, most recent first */
+	struct istr *next;
+};
+
+/*
+ * Subscriber of -S.  It sends one request line "FORMAT [PID]" and then
+ * receives records in that format, only for descendants of PID if
+ * given.  Output is queued in a ring of CLIENT_BUF bytes, records that
+ * don't fit are dropped for that client only.
+ */
+#define CLIENT_BUF (1 << 20)
+#define MAXANC 1024		/* ancestors looked at for a client root */
+
+struct client {
+	int fd;
+	int format;		/* -1 until the request was read */
+	pid_t root;
+	struct extrace_filter *filter;	/* or NULL */
+	char req[1024];
+	size_t reqlen;
+	char *ring;
+	uint64_t head;
+	uint64_t tail;
+	int want_write;		/* EVFILT_WRITE is enabled */
+	unsigned long dropped;
+	struct client *next;
+};
+
+/* references of one event, id+1 or 0 for NULL.  */
+struct irefs {
+	unsigned cwd;
+	unsigned path;
+	unsigned argv0;
+	unsigned envp;
+};
+
+enum { FMT_TEXT, FMT_BIN, FMT_JSON, FMT_CHROME, FMT_FOLDED, FMT_COMPDB };
+
+enum { COMP_NONE, COMP_ZSTD, COMP_LZ4 };
+enum { COMP_DATA, COMP_FLUSH, COMP_END };
+
+/* bytes queued for the compressor before backpressure applies.  */
+#define COMP_QUEUE (16 << 20)
+
+static FILE *output;
+static const char *outfile;
+static struct ring *ring;
+static size_t ring_size;
+static const char *shmname;
+static unsigned long ring_dropped;
+static size_t rotate_size;
+static int rotate_interval;
+static int rotate_gzip = 0;
+static FILE *next_output;	/* opened ahead of the next rotation */
+static size_t outbytes;		/* written to the current segment */
+static unsigned rotate_seq;
+static pid_t *roots;		/* -p, all processes if none */
+static size_t nroots;
+static pid_t *excludes;		/* -x */
+static size_t nexcludes;
+static int flat = 0;
+static int self_trace = 0;
+static int profile = 0;		/* -P */
+static int proctree = 0;	/* keep the processes, for -P, -C or -O folded */
+static int show_args = 1;
+static int trace_flags = 0;	/* EXTRACE_* */
+static const char *filter;
+static const char *tagfile;
+static const char *limitv[8];	/* -L */
+static int nlimitv;
+static unsigned sample;		/* -n */
+static const char *capfile;	/* -W */
+static FILE *capture;
+static const char *replayfile;	/* -R */
+static int format = FMT_TEXT;
+static int intern = 0;
+
+static struct extrace *tracer;
+static int kq;
+static int quit = 0;
+static uint64_t t_start;	/* monotonic, when tracing started */
+static struct extrace_hist t_format, t_write, t_flush;
+static struct extrace_hist t_prof, t_serve, t_intern;
+static uint64_t t_bytes;	/* formatted */
+
+static const char *sockpath;	/* serve subscribers on this socket */
+static int lfd = -1;
+static struct client *clients;
+static unsigned long clients_dropped;
+
+static struct buf obuf;		/* formatted output */
+
+static struct istr *itab[INTERN_MAX];
+static struct istr ient[INTERN_MAX];
+static struct istr ilru = { .prev = &ilru, .next = &ilru };
+static struct istr *ifree;
+static size_t inum, ibytes;
+static struct buf ibuf;		/* serialized vector being interned */
+
+/* rotated segments waiting for the gzip thread.  */
+struct gzjob {
+	char *file;
+	struct gzjob *next;
+};
+static struct gzjob *gzqueue;
+static pthread_t gzthread;
+static pthread_mutex_t gzlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gzcond = PTHREAD_COND_INITIALIZER;
+static int gzdone = 0;
+
+/* streaming compression of the output, see compress_worker().  */
+static int compress_method = COMP_NONE;
+static int backpressure_drop = 0;
+static pthread_t cthread;
+static pthread_mutex_t cmtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cwork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t cspace = PTHREAD_COND_INITIALIZER;
+static struct buf cpending;	/* output waiting for the compressor */
+#if defined(HAVE_ZSTD) || defined(HAVE_LZ4)
+static struct buf cout;		/* compressed data */
+#endif
+static int cdone = 0;
+static uint64_t cbytes_in, cbytes_out;	/* published under cmtx */
+static uint64_t wbytes_in, wbytes_out;	/* counted by the compressor */
+static unsigned long cdropped, cwaits;
+static struct timespec ccpu;
+#ifdef HAVE_ZSTD
+static ZSTD_CCtx *zctx;
+#endif
+#ifdef HAVE_LZ4
+static LZ4F_cctx *lctx;
+#endif
+
+static void
+buf_grow(struct buf *b, size_t n)
+{
+	if (b->len + n <= b->cap)
+		return;
+	while (b->len + n > b->cap)
+		b->cap = b->cap ? 2*b->cap : 4096;
+	if (!(b->s = realloc(b->s, b->cap)))
+		err(1, "realloc");
+}
+
+static void
+buf_put(struct buf *b, const void *p, size_t n)
+{
+	buf_grow(b, n);
+	memcpy(b->s + b->len, p, n);
+	b->len += n;
+}
+
+static void
+buf_putc(struct buf *b, int c)
+{
+	buf_grow(b, 1);
+	b->s[b->len++] = c;
+}
+
+static void
+buf_puts(struct buf *b, const char *s)
+{
+	buf_put(b, s, strlen(s));
+}
+
+static void
+buf_printf(struct buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(b->s + b->len, b->cap - b->len, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	if ((size_t)n >= b->cap - b->len) {
+		buf_grow(b, n + 1);
+		va_start(ap, fmt);
+		vsnprintf(b->s + b->len, b->cap - b->len, fmt, ap);
+		va_end(ap);
+	}
+	b->len += n;
+}
+
+static void
+buf_putvar(struct buf *b, uint64_t v)
+{
+	char c[10];
+	int n = 0;
+
+	do {
+		c[n++] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+		v >>= 7;
+	} while (v);
+	buf_put(b, c, n);
+}
+
+static void
+buf_putstr(struct buf *b, const char *s)
+{
+	size_t n;
+
+	if (!s) {
+		buf_putc(b, 0);
+		return;
+	}
+	n = strlen(s);
+	buf_putvar(b, n + 1);
+	buf_put(b, s, n);
+}
+
+static void
+buf_putstrv(struct buf *b, char **v)
+{
+	size_t n;
+
+	if (!v) {
+		buf_putc(b, 0);
+		return;
+	}
+	for (n = 0; v[n]; n++)
+		;
+	buf_putvar(b, n + 1);
+	for (; *v; v++)
+		buf_putstr(b, *v);
+}
+
+/* copy the NULL-terminated vector v into b, which is reset.  */
+static char **
+save_strv(struct buf *b, char **v)
+{
+	char **r, *p;
+	size_t n, sz = 0, i;
+
+	for (n = 0; v[n]; n++)
+		sz += strlen(v[n]) + 1;
+	b->len = 0;
+	buf_grow(b, (n+1) * sizeof (char *) + sz);
+	r = (char **)b->s;
+	p = b->s + (n+1) * sizeof (char *);
+	for (i = 0; i < n; i++) {
+		r[i] = p;
+		p = stpcpy(p, v[i]) + 1;
+	}
+	r[n] = 0;
+	b->len = p - b->s;
+	return r;
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Parse a decimal number up to max at s and set *end after it.  Returns
+ * 0 with *end at s if there is none, or it is out of range.
+ */
+static unsigned long
+strnum(const char *s, char **end, unsigned long max)
+{
+	unsigned long n;
+
+	*end = (char *)s;
+	if (!isdigit((unsigned char)*s))
+		return 0;
+	errno = 0;
+	n = strtoul(s, end, 10);
+	if (errno || n > max) {
+		*end = (char *)s;
+		return 0;
+	}
+	return n;
+}
+
+static const char shmeta[] =
+    "\001\002\003\004\005\006\007\010"
+    "\011\012\013\014\015\016\017\020"
+    "\021\022\023\024\025\026\027\030"
+    "\031\032\033\034\035\036\037\040"
+    "`^#*[]=|\\?${}()'\"<>&;\177";
+
+/* quote the first n bytes of the string s.  */
+static void
+print_shquoted(struct buf *b, const char *s, size_t n)
+{
+	if (n && strcspn(s, shmeta) >= n) {
+		buf_put(b, s, n);
+		return;
+	}
+
+	buf_putc(b, '\'');
+	for (; n; s++, n--)
+		if (*s == '\'')
+			buf_puts(b, "'\\''");
+		else if (*s == '\n')
+			buf_puts(b, "'$'\\n''");
+		else
+			buf_putc(b, *s);
+	buf_putc(b, '\'');
+}
+
+/*
+ * JSON string escaping: jsonclass[] is 0 for bytes copied verbatim,
+ * 1 for bytes that need a backslash escape, 2..4 for the lead byte
+ * of a UTF-8 sequence of that length and 5 for other bytes.  Runs of
+ * clean bytes and valid UTF-8 are copied in one go, invalid bytes
+ * become U+FFFD.
+ */
+static unsigned char jsonclass[256];
+
+static void
+json_init(void)
+{
+	int c;
+
+	for (c = 0; c < 0x20; c++)
+		jsonclass[c] = 1;
+	jsonclass['"'] = jsonclass['\\'] = 1;
+	for (c = 0x80; c < 0x100; c++)
+		jsonclass[c] = 5;  /* continuation or invalid lead byte */
+	for (c = 0xc2; c < 0xe0; c++)
+		jsonclass[c] = 2;
+	for (c = 0xe0; c < 0xf0; c++)
+		jsonclass[c] = 3;
+	for (c = 0xf0; c < 0xf5; c++)
+		jsonclass[c] = 4;
+}
+
+/* length of the valid UTF-8 sequence at s, or 0.  */
+static int
+utf8_len(const unsigned char *s, const unsigned char *end)
+{
+	int n = jsonclass[*s], i;
+
+	if (n < 2 || n > 4 || end - s < n)
+		return 0;
+	for (i = 1; i < n; i++)
+		if ((s[i] & 0xc0) != 0x80)
+			return 0;
+	/* overlong forms, surrogates and code points above U+10FFFF.  */
+	if ((s[0] == 0xe0 && s[1] < 0xa0) ||
+	    (s[0] == 0xed && s[1] > 0x9f) ||
+	    (s[0] == 0xf0 && s[1] < 0x90) ||
+	    (s[0] == 0xf4 && s[1] > 0x8f))
+		return 0;
+	return n;
+}
+
+/* quote the first n bytes of the string s as JSON string.  */
+static void
+print_json(struct buf *b, const char *str, size_t n)
+{
+	const unsigned char *s = (const unsigned char *)str;
+	const unsigned char *end = s + n, *run;
+	int l;
+
+	buf_putc(b, '"');
+	while (s < end) {
+		for (run = s; s < end; s++) {
+			if (jsonclass[*s] == 0)
+				continue;
+			if (jsonclass[*s] == 1 || !(l = utf8_len(s, end)))
+				break;
+			s += l - 1;
+		}
+		buf_put(b, run, s - run);
+		if (s == end)
+			break;
+
+		switch (*s) {
+		case '"': buf_puts(b, "\\\""); break;
+		case '\\': buf_puts(b, "\\\\"); break;
+		case '\n': buf_puts(b, "\\n"); break;
+		case '\t': buf_puts(b, "\\t"); break;
+		case '\r': buf_puts(b, "\\r"); break;
+		default:
+			if (*s < 0x20)
+				buf_printf(b, "\\u%04x", *s);
+			else
+				buf_puts(b, "\\ufffd");
+		}
+		s++;
+	}
+	buf_putc(b, '"');
+}
+
+static void
+print_json_str(struct buf *b, const char *s)
+{
+	if (s)
+		print_json(b, s, strlen(s));
+	else
+		buf_puts(b, "null");
+}
+
+static void
+print_json_env(struct buf *b, char **envp)
+{
+	char **pp;
+	char *eq;
+
+	if (!envp) {
+		buf_puts(b, "null");
+		return;
+	}
+	buf_putc(b, '{');
+	for (pp = envp; *pp; pp++) {
+		if (pp != envp)
+			buf_putc(b, ',');
+		if ((eq = strchr(*pp, '='))) {
+			print_json(b, *pp, eq - *pp);
+			buf_putc(b, ':');
+			print_json_str(b, eq+1);
+		} else {
+			print_json_str(b, *pp);
+			buf_puts(b, ":null");
+		}
+	}
+	buf_putc(b, '}');
+}
+
+static void
+print_json_ref(struct buf *b, unsigned ref)
+{
+	if (ref)
+		buf_printf(b, "{\"ref\":%u}", ref - 1);
+	else
+		buf_puts(b, "null");
+}
+
+static void
+format_json(struct buf *b, struct exec_event *ev, struct irefs *ir)
+{
+	char **pp;
+
+	buf_printf(b, "{\"pid\":%d,\"ppid\":%d,", ev->pid, ev->ppid);
+	if (ev->depth >= 0)
+		buf_printf(b, "\"depth\":%d,", ev->depth);
+	else
+		buf_puts(b, "\"depth\":null,");
+	buf_printf(b, "\"time\":%llu.%09llu,",
+	    (unsigned long long)(ev->time / 1000000000),
+	    (unsigned long long)(ev->time % 1000000000));
+
+	buf_puts(b, "\"exe\":");
+	if (ir)
+		print_json_ref(b, ev->path ? ir->path : ir->argv0);
+	else
+		print_json_str(b, ev->path ? ev->path : ev->argv[0]);
+
+	buf_puts(b, ",\"argv\":[");
+	for (pp = ev->argv; *pp; pp++) {
+		if (pp != ev->argv)
+			buf_putc(b, ',');
+		if (ir && pp == ev->argv)
+			print_json_ref(b, ir->argv0);
+		else
+			print_json_str(b, *pp);
+		if (!show_args)
+			break;
+	}
+	buf_putc(b, ']');
+
+	if (ev->flags & REC_CWD) {
+		buf_puts(b, ",\"cwd\":");
+		if (ir)
+			print_json_ref(b, ir->cwd);
+		else
+			print_json_str(b, ev->cwd);
+	}
+
+	if (ev->flags & REC_ENV) {
+		buf_puts(b, ",\"env\":");
+		if (ir)
+			print_json_ref(b, ir->envp);
+		else
+			print_json_env(b, ev->envp);
+		if (ev->flags & REC_ENVDIFF) {
+			buf_puts(b, ",\"unset\":[");
+			for (pp = ev->unset; pp && *pp; pp++) {
+				if (pp != ev->unset)
+					buf_putc(b, ',');
+				print_json_str(b, *pp);
+			}
+			buf_putc(b, ']');
+		}
+	}
+
+	if (ev->flags & REC_TAGS) {
+		buf_puts(b, ",\"tags\":[");
+		for (pp = ev->tags; pp && *pp; pp++) {
+			if (pp != ev->tags)
+				buf_putc(b, ',');
+			print_json_str(b, *pp);
+		}
+		buf_putc(b, ']');
+	}
+
+	buf_puts(b, "}\n");
+}
+
+static void
+format_text(struct buf *b, struct exec_event *ev)
+{
+	char **pp = ev->argv;
+	char *eq;
+
+	if (!flat && ev->depth >= 0)
+		buf_printf(b, "%*s", 2*ev->depth, "");
+	buf_printf(b, "%d ", ev->pid);
+
+	if (ev->flags & REC_CWD) {
+		if (ev->cwd)
+			print_shquoted(b, ev->cwd, strlen(ev->cwd));
+		else
+			buf_putc(b, '?');
+		buf_puts(b, " % ");
+	}
+
+	if (ev->path)
+		print_shquoted(b, ev->path, strlen(ev->path));
+	else if (*pp)
+		print_shquoted(b, *pp, strlen(*pp));
+	if (*pp)
+		pp++;
+
+	if (show_args)
+		for (; *pp; pp++) {
+			buf_putc(b, ' ');
+			print_shquoted(b, *pp, strlen(*pp));
+		}
+
+	if (ev->flags & REC_ENV) {
+		if ((pp = ev->unset))
+			for (; *pp; pp++) {
+				buf_puts(b, " -u ");
+				print_shquoted(b, *pp, strlen(*pp));
+			}
+		if ((pp = ev->envp)) {
+			for (; *pp; pp++) {
+				buf_putc(b, ' ');
+				if ((eq = strchr(*pp, '='))) {
+					/* print split so = doesn't trigger escaping.  */
+					print_shquoted(b, *pp, eq - *pp);
+					buf_putc(b, '=');
+					print_shquoted(b, eq+1, strlen(eq+1));
+				} else {
+					/* weird env entry without equal sign.  */
+					print_shquoted(b, *pp, strlen(*pp));
+				}
+			}
+		} else {
+			buf_puts(b, " -");
+		}
+	}
+
+	if (ev->tags && *ev->tags) {
+		buf_puts(b, " #");
+		for (pp = ev->tags; *pp; pp++) {
+			buf_putc(b, ' ');
+			print_shquoted(b, *pp, strlen(*pp));
+		}
+	}
+
+	buf_putc(b, '\n');
+}
+
+/* reserve room for the longest length prefix, rec_end() moves it in place.  */
+static size_t
+rec_begin(struct buf *b)
+{
+	buf_grow(b, 10);
+	return b->len += 10;
+}
+
+static void
+rec_end(struct buf *b, size_t start)
+{
+	size_t len = b->len - start;
+	char hdr[10];
+	int n = 0;
+
+	do {
+		hdr[n++] = (len & 0x7f) | (len > 0x7f ? 0x80 : 0);
+		len >>= 7;
+	} while (len);
+	memcpy(b->s + start - sizeof hdr, hdr, n);
+	memmove(b->s + start - sizeof hdr + n, b->s + start, b->len - start);
+	b->len -= sizeof hdr - n;
+}
+
+static void
+format_bin(struct buf *b, struct exec_event *ev, struct irefs *ir)
+{
+	size_t start;
+
+	start = rec_begin(b);
+	buf_putc(b, REC_EXEC);
+	buf_putvar(b, ev->flags | (ir ? REC_INTERN : 0));
+	buf_putvar(b, ev->time);
+	buf_putvar(b, ev->pid);
+	buf_putvar(b, ev->ppid);
+	buf_putvar(b, ev->depth + 1);
+	if (ir) {
+		if (ev->flags & REC_CWD)
+			buf_putvar(b, ir->cwd);
+		if (ev->flags & REC_PATH)
+			buf_putvar(b, ir->path);
+		buf_putvar(b, ir->argv0);
+		buf_putstrv(b, *ev->argv ? ev->argv + 1 : ev->argv);
+		if (ev->flags & REC_ENV)
+			buf_putvar(b, ir->envp);
+		if (ev->flags & REC_ENVDIFF)
+			buf_putstrv(b, ev->unset);
+	} else {
+		if (ev->flags & REC_CWD)
+			buf_putstr(b, ev->cwd);
+		if (ev->flags & REC_PATH)
+			buf_putstr(b, ev->path);
+		buf_putstrv(b, ev->argv);
+		if (ev->flags & REC_ENV)
+			buf_putstrv(b, ev->envp);
+		if (ev->flags & REC_ENVDIFF)
+			buf_putstrv(b, ev->unset);
+	}
+	if (ev->flags & REC_TAGS)
+		buf_putstrv(b, ev->tags);
+	rec_end(b, start);
+}
+
+static uint32_t
+hash_bytes(const char *s, size_t len)
+{
+	uint32_t h = 2166136261u;
+
+	while (len--)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+static void
+lru_unlink(struct istr *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static void
+lru_push(struct istr *e)
+{
+	e->next = ilru.next;
+	e->prev = &ilru;
+	ilru.next->prev = e;
+	ilru.next = e;
+}
+
+static void
+intern_evict(struct istr *e)
+{
+	struct istr **ep;
+
+	for (ep = &itab[e->hash % INTERN_MAX]; *ep != e; ep = &(*ep)->hnext)
+		;
+	*ep = e->hnext;
+	lru_unlink(e);
+	ibytes -= e->len;
+	free(e->data);
+	e->data = 0;
+	e->hnext = ifree;
+	ifree = e;
+}
+
+/* return the id of the len bytes at data, *isnew is set for new ids.  */
+static unsigned
+intern_id(int kind, const char *data, size_t len, int *isnew)
+{
+	uint32_t h = hash_bytes(data, len) ^ kind;
+	struct istr *e;
+
+	for (e = itab[h % INTERN_MAX]; e; e = e->hnext)
+		if (e->hash == h && e->kind == kind && e->len == len &&
+		    memcmp(e->data, data, len) == 0) {
+			lru_unlink(e);
+			lru_push(e);
+			*isnew = 0;
+			return e - ient;
+		}
+
+	while (ilru.prev != &ilru &&
+	    (ibytes + len > INTERN_BYTES || (!ifree && inum == INTERN_MAX)))
+		intern_evict(ilru.prev);
+	if (ifree) {
+		e = ifree;
+		ifree = e->hnext;
+	} else {
+		e = &ient[inum++];
+	}
+
+	e->hash = h;
+	e->kind = kind;
+	e->len = len;
+	if (!(e->data = malloc(len ? len : 1)))
+		err(1, "malloc");
+	memcpy(e->data, data, len);
+	e->hnext = itab[h % INTERN_MAX];
+	itab[h % INTERN_MAX] = e;
+	lru_push(e);
+	ibytes += len;
+	*isnew = 1;
+	return e - ient;
+}
+
+/* intern s or v, emitting a definition into b if needed.  */
+static unsigned
+intern_ref(struct buf *b, int kind, char *s, char **v)
+{
+	unsigned id;
+	size_t start;
+	char **pp;
+	int isnew;
+
+	if (kind == INTERN_STR && !s)
+		return 0;
+	if (kind == INTERN_ENV && !v)
+		return 0;
+
+	if (kind == INTERN_STR) {
+		id = intern_id(kind, s, strlen(s), &isnew);
+	} else {
+		ibuf.len = 0;
+		for (pp = v; *pp; pp++)
+			buf_put(&ibuf, *pp, strlen(*pp) + 1);
+		id = intern_id(kind, ibuf.s, ibuf.len, &isnew);
+	}
+	if (!isnew)
+		return id + 1;
+
+	if (format == FMT_BIN) {
+		start = rec_begin(b);
+		buf_putc(b, REC_DEF);
+		buf_putvar(b, id);
+		buf_putc(b, kind);
+		if (kind == INTERN_STR)
+			buf_putstr(b, s);
+		else
+			buf_putstrv(b, v);
+		rec_end(b, start);
+	} else {
+		buf_printf(b, "{\"def\":%u,", id);
+		if (kind == INTERN_STR) {
+			buf_puts(b, "\"str\":");
+			print_json_str(b, s);
+		} else {
+			buf_puts(b, "\"env\":");
+			print_json_env(b, v);
+		}
+		buf_puts(b, "}\n");
+	}
+	return id + 1;
+}
+
+static void
+intern_event(struct buf *b, struct exec_event *ev, struct irefs *ir)
+{
+	memset(ir, 0, sizeof *ir);
+	if (ev->flags & REC_CWD)
+		ir->cwd = intern_ref(b, INTERN_STR, ev->cwd, 0);
+	if (ev->flags & REC_PATH)
+		ir->path = intern_ref(b, INTERN_STR, ev->path, 0);
+	ir->argv0 = intern_ref(b, INTERN_STR, *ev->argv, 0);
+	if (ev->flags & REC_ENV)
+		ir->envp = intern_ref(b, INTERN_ENV, 0, ev->envp);
+}
+
+/* copy n bytes from p into the ring at byte position off.  */
+static void
+ring_put(uint64_t off, const char *p, size_t n)
+{
+	size_t o = off % ring->size;
+	size_t m = n < ring->size - o ? n : ring->size - o;
+
+	memcpy(ring->data + o, p, m);
+	memcpy(ring->data, p + m, n - m);
+}
+
+/* total length of the record at byte position off.  */
+static uint64_t
+ring_reclen(uint64_t off)
+{
+	uint64_t len = 0;
+	int c, i = 0;
+
+	do {
+		c = (unsigned char)ring->data[(off + i) % ring->size];
+		len |= (uint64_t)(c & 0x7f) << (7*i);
+		i++;
+	} while (c & 0x80 && i < 10);
+	return len + i;
+}
+
+/* only stores into the mapping, no system calls.  */
+static void
+ring_write(const char *p, size_t n)
+{
+	uint64_t tail;
+
+	if (n > ring->size) {
+		ring_dropped++;
+		return;
+	}
+
+	ring->gen++;
+	for (tail = ring->tail; ring->head + n - tail > ring->size; )
+		tail += ring_reclen(tail);
+	/* readers must see the new tail before the overwritten data.  */
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	ring_put(ring->head, p, n);
+	__atomic_store_n(&ring->head, ring->head + n, __ATOMIC_RELEASE);
+	ring->gen++;
+}
+
+/* map a ring file, or a shared memory object if shm.  */
+static void
+ring_open(const char *file, size_t size, int shm)
+{
+	struct ring hdr;
+	size_t total;
+	int fd;
+
+	if (shm)
+		fd = shm_open(file, O_RDWR | O_CREAT, 0644);
+	else
+		fd = open(file, O_RDWR | O_CREAT, 0666);
+	if (fd == -1)
+		err(1, "%s", file);
+	total = sizeof hdr + size;
+
+	/* keep the history of a ring of the same size.  */
+	if (read(fd, &hdr, sizeof hdr) != sizeof hdr ||
+	    memcmp(hdr.magic, RING_MAGIC, sizeof hdr.magic) != 0 ||
+	    hdr.size != size) {
+		if (ftruncate(fd, 0) == -1 || ftruncate(fd, total) == -1)
+			err(1, "%s: ftruncate", file);
+		/* preallocate if the file system supports it.  */
+		if (!shm)
+			posix_fallocate(fd, 0, total);
+	}
+
+	ring = mmap(0, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED)
+		err(1, "%s: mmap", file);
+	close(fd);
+
+	if (memcmp(ring->magic, RING_MAGIC, sizeof ring->magic) != 0) {
+		memcpy(ring->magic, RING_MAGIC, sizeof ring->magic);
+		ring->size = size;
+		ring->head = ring->tail = ring->gen = 0;
+	} else if (ring->gen & 1) {
+		/* a previous writer died during an update.  */
+		ring->gen++;
+	}
+}
+
+static void
+intern_reset(void)
+{
+	size_t i;
+
+	for (i = 0; i < inum; i++) {
+		free(ient[i].data);
+		ient[i].data = 0;
+	}
+	memset(itab, 0, sizeof itab);
+	ilru.prev = ilru.next = &ilru;
+	ifree = 0;
+	inum = ibytes = 0;
+}
+
+static int
+gzip_file(const char *file)
+{
+	char gzfile[PATH_MAX], buf[65536];
+	gzFile gz;
+	FILE *in;
+	size_t n;
+	int ok = 1;
+
+	snprintf(gzfile, sizeof gzfile, "%s.gz", file);
+	if (!(in = fopen(file, "r")))
+		return -1;
+	if (!(gz = gzopen(gzfile, "wb"))) {
+		fclose(in);
+		return -1;
+	}
+	while ((n = fread(buf, 1, sizeof buf, in)) > 0)
+		if (gzwrite(gz, buf, n) != (int)n) {
+			ok = 0;
+			break;
+		}
+	if (ferror(in))
+		ok = 0;
+	fclose(in);
+	if (gzclose(gz) != Z_OK)
+		ok = 0;
+	if (!ok) {
+		unlink(gzfile);
+		return -1;
+	}
+	return unlink(file);
+}
+
+static void *
+gzip_worker(void *arg)
+{
+	struct gzjob *j;
+
+	(void)arg;
+	pthread_mutex_lock(&gzlock);
+	for (;;) {
+		while (!gzqueue && !gzdone)
+			pthread_cond_wait(&gzcond, &gzlock);
+		if (!(j = gzqueue))
+			break;
+		gzqueue = j->next;
+		pthread_mutex_unlock(&gzlock);
+
+		if (gzip_file(j->file) == -1)
+			warnx("can't compress %s", j->file);
+		free(j->file);
+		free(j);
+
+		pthread_mutex_lock(&gzlock);
+	}
+	pthread_mutex_unlock(&gzlock);
+	return 0;
+}
+
+static void
+gzip_queue(const char *file)
+{
+	struct gzjob *j, **jp;
+
+	if (!(j = malloc(sizeof *j)) || !(j->file = strdup(file)))
+		err(1, "malloc");
+	j->next = 0;
+	pthread_mutex_lock(&gzlock);
+	for (jp = &gzqueue; *jp; jp = &(*jp)->next)
+		;
+	*jp = j;
+	pthread_cond_signal(&gzcond);
+	pthread_mutex_unlock(&gzlock);
+}
+
+static void
+gzip_finish(void)
+{
+	pthread_mutex_lock(&gzlock);
+	gzdone = 1;
+	pthread_cond_signal(&gzcond);
+	pthread_mutex_unlock(&gzlock);
+	pthread_join(gzthread, 0);
+}
+
+static FILE *
+open_next(void)
+{
+	char next[PATH_MAX];
+	FILE *f;
+
+	snprintf(next, sizeof next, "%s.next", outfile);
+	if (!(f = fopen(next, "w")))
+		warn("%s", next);
+	return f;
+}
+
+/*
+ * Rotate between two records: the current segment is renamed to
+ * FILE.N and the file opened ahead of time becomes FILE.
+ */
+static void
+rotate(void)
+{
+	char seg[PATH_MAX], next[PATH_MAX];
+
+	if (!next_output && !(next_output = open_next()))
+		return;  /* keep writing to the current segment */
+
+	do
+		snprintf(seg, sizeof seg, "%s.%u", outfile, ++rotate_seq);
+	while (access(seg, F_OK) == 0 ||
+	    (rotate_gzip && snprintf(next, sizeof next, "%s.gz", seg) > 0 &&
+	    access(next, F_OK) == 0));
+	snprintf(next, sizeof next, "%s.next", outfile);
+
+	fclose(output);
+	if (rename(outfile, seg) == -1 || rename(next, outfile) == -1)
+		warn("rename");
+	else if (rotate_gzip)
+		gzip_queue(seg);
+	output = next_output;
+	next_output = open_next();
+	outbytes = 0;
+
+	/* each segment is self-contained.  */
+	if (format == FMT_BIN)
+		fwrite(BIN_MAGIC, 1, sizeof BIN_MAGIC - 1, output);
+	if (intern)
+		intern_reset();
+}
+
+#if defined(HAVE_ZSTD) || defined(HAVE_LZ4)
+static void
+compress_write(const char *p, size_t n)
+{
+	if (fwrite(p, 1, n, output) != n)
+		warn("write");
+	wbytes_out += n;
+}
+#endif
+
+/* runs on the compressor thread only.  */
+static void
+compress_chunk(const char *p, size_t n, int mode)
+{
+	wbytes_in += n;
+#ifdef HAVE_ZSTD
+	if (compress_method == COMP_ZSTD) {
+		ZSTD_inBuffer in = { p, n, 0 };
+		ZSTD_outBuffer out;
+		ZSTD_EndDirective d = mode == COMP_END ? ZSTD_e_end :
+		    mode == COMP_FLUSH ? ZSTD_e_flush : ZSTD_e_continue;
+		size_t r;
+
+		do {
+			out.dst = cout.s;
+			out.size = cout.cap;
+			out.pos = 0;
+			r = ZSTD_compressStream2(zctx, &out, &in, d);
+			if (ZSTD_isError(r))
+				errx(1, "zstd: %s", ZSTD_getErrorName(r));
+			compress_write(cout.s, out.pos);
+		} while (d == ZSTD_e_continue ? in.pos < in.size : r != 0);
+	}
+#endif
+#ifdef HAVE_LZ4
+	if (compress_method == COMP_LZ4) {
+		size_t r;
+
+		cout.len = 0;
+		buf_grow(&cout, LZ4F_compressBound(n, 0));
+		if (mode == COMP_END)
+			r = LZ4F_compressEnd(lctx, cout.s, cout.cap, 0);
+		else if (mode == COMP_FLUSH)
+			r = LZ4F_flush(lctx, cout.s, cout.cap, 0);
+		else
+			r = LZ4F_compressUpdate(lctx, cout.s, cout.cap, p, n, 0);
+		if (LZ4F_isError(r))
+			errx(1, "lz4: %s", LZ4F_getErrorName(r));
+		compress_write(cout.s, r);
+	}
+#endif
+	(void)p;
+	(void)mode;
+}
+
+/*
+ * The compressor thread takes whatever the tracing thread queued in
+ * cpending and swaps in an empty buffer, so the tracing thread only
+ * waits for the lock, or for space under the block policy.  The stream
+ * is flushed whenever the queue runs empty, so a compressed trace is
+ * readable up to the last record while extrace is running.
+ */
+static void *
+compress_worker(void *arg)
+{
+	struct buf work = { 0 }, tmp;
+
+	(void)arg;
+	pthread_mutex_lock(&cmtx);
+	for (;;) {
+		while (!cpending.len && !cdone)
+			pthread_cond_wait(&cwork, &cmtx);
+		if (!cpending.len)
+			break;
+		tmp = work;
+		work = cpending;
+		cpending = tmp;
+		cpending.len = 0;
+		pthread_cond_broadcast(&cspace);
+		pthread_mutex_unlock(&cmtx);
+
+		compress_chunk(work.s, work.len, COMP_DATA);
+
+		pthread_mutex_lock(&cmtx);
+		if (!cpending.len) {
+			pthread_mutex_unlock(&cmtx);
+			compress_chunk(0, 0, COMP_FLUSH);
+			fflush(output);
+			pthread_mutex_lock(&cmtx);
+		}
+		cbytes_in = wbytes_in;
+		cbytes_out = wbytes_out;
+	}
+	pthread_mutex_unlock(&cmtx);
+
+	compress_chunk(0, 0, COMP_END);
+	fflush(output);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ccpu);
+	pthread_mutex_lock(&cmtx);
+	cbytes_in = wbytes_in;
+	cbytes_out = wbytes_out;
+	pthread_mutex_unlock(&cmtx);
+	free(work.s);
+	return 0;
+}
+
+/* queue n bytes for the compressor, returns -1 if they were dropped.  */
+static int
+compress_put(const char *p, size_t n)
+{
+	pthread_mutex_lock(&cmtx);
+	while (cpending.len > 0 && cpending.len + n > COMP_QUEUE) {
+		if (backpressure_drop) {
+			cdropped++;
+			pthread_mutex_unlock(&cmtx);
+			return -1;
+		}
+		cwaits++;
+		pthread_cond_wait(&cspace, &cmtx);
+	}
+	buf_put(&cpending, p, n);
+	if (cpending.len == n)
+		pthread_cond_signal(&cwork);
+	pthread_mutex_unlock(&cmtx);
+	return 0;
+}
+
+static void
+compress_start(void)
+{
+#ifdef HAVE_ZSTD
+	if (compress_method == COMP_ZSTD) {
+		if (!(zctx = ZSTD_createCCtx()))
+			errx(1, "ZSTD_createCCtx failed");
+		ZSTD_CCtx_setParameter(zctx, ZSTD_c_compressionLevel, 3);
+		buf_grow(&cout, ZSTD_CStreamOutSize());
+	}
+#endif
+#ifdef HAVE_LZ4
+	if (compress_method == COMP_LZ4) {
+		size_t r;
+
+		if (LZ4F_isError(LZ4F_createCompressionContext(&lctx, LZ4F_VERSION)))
+			errx(1, "LZ4F_createCompressionContext failed");
+		buf_grow(&cout, LZ4F_HEADER_SIZE_MAX);
+		r = LZ4F_compressBegin(lctx, cout.s, cout.cap, 0);
+		if (LZ4F_isError(r))
+			errx(1, "lz4: %s", LZ4F_getErrorName(r));
+		compress_write(cout.s, r);
+	}
+#endif
+	if ((errno = pthread_create(&cthread, 0, compress_worker, 0)))
+		err(1, "pthread_create");
+}
+
+static void
+compress_finish(void)
+{
+	pthread_mutex_lock(&cmtx);
+	cdone = 1;
+	pthread_cond_signal(&cwork);
+	pthread_mutex_unlock(&cmtx);
+	pthread_join(cthread, 0);
+#ifdef HAVE_ZSTD
+	if (zctx)
+		ZSTD_freeCCtx(zctx);
+#endif
+#ifdef HAVE_LZ4
+	if (lctx)
+		LZ4F_freeCompressionContext(lctx);
+#endif
+}
+
+/* also while running: the thread's cpu clock gives its time so far.  */
+static void
+print_compress_stats(void)
+{
+	struct timespec cpu;
+	clockid_t cid;
+	uint64_t in, out;
+	unsigned long waits, dropped;
+	int done;
+
+	pthread_mutex_lock(&cmtx);
+	in = cbytes_in;
+	out = cbytes_out;
+	waits = cwaits;
+	dropped = cdropped;
+	done = cdone;
+	pthread_mutex_unlock(&cmtx);
+	if (done)
+		cpu = ccpu;
+	else if (pthread_getcpuclockid(cthread, &cid) != 0 ||
+	    clock_gettime(cid, &cpu) == -1)
+		cpu.tv_sec = cpu.tv_nsec = 0;
+	fprintf(stderr, "extrace: compressed %llu bytes to %llu (ratio %.2f) "
+	    "in %ld.%03lds cpu, %lu waits, %lu records dropped\n",
+	    (unsigned long long)in, (unsigned long long)out,
+	    out ? (double)in / out : 0.0,
+	    (long)cpu.tv_sec, cpu.tv_nsec / 1000000, waits, dropped);
+}
+
+static void
+out_write(const char *p, size_t n)
+{
+	if (ring) {
+		ring_write(p, n);
+	} else if (compress_method) {
+		/* later records may refer to definitions that were dropped.  */
+		if (compress_put(p, n) == -1 && intern)
+			intern_reset();
+	} else {
+		fwrite(p, 1, n, output);
+	}
+	outbytes += n;
+}
+
+static void
+client_close(struct client *c)
+{
+	struct client **cp;
+
+	for (cp = &clients; *cp != c; cp = &(*cp)->next)
+		;
+	*cp = c->next;
+	clients_dropped += c->dropped;
+	close(c->fd);	/* also removes its kevents */
+	extrace_filter_free(tracer, c->filter);
+	free(c->ring);
+	free(c);
+}
+
+static struct client *
+client_find(int fd)
+{
+	struct client *c;
+
+	for (c = clients; c; c = c->next)
+		if (c->fd == fd)
+			return c;
+	return 0;
+}
+
+static void
+client_accept(void)
+{
+	struct kevent kev;
+	struct client *c;
+	int fd;
+
+	if ((fd = accept(lfd, 0, 0)) == -1)
+		return;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	if (!(c = calloc(1, sizeof *c)) || !(c->ring = malloc(CLIENT_BUF)))
+		err(1, "malloc");
+	c->fd = fd;
+	c->format = -1;
+	c->next = clients;
+	clients = c;
+
+	EV_SET(&kev, fd, EVFILT_READ, EV_ADD, 0, 0, 0);
+	if (kevent(kq, &kev, 1, 0, 0, 0) == -1)
+		client_close(c);
+}
+
+/* parse "FORMAT [PID] [FILTER]", returns -1 on error.  */
+static int
+client_request(struct client *c)
+{
+	const char *errstr;
+	char *fmt, *pid = 0, *expr, *end;
+
+	fmt = c->req + strspn(c->req, " \t\r");
+	expr = fmt + strcspn(fmt, " \t\r");
+	if (*expr)
+		*expr++ = 0;
+	expr += strspn(expr, " \t\r");
+	if (isdigit((unsigned char)*expr)) {
+		pid = expr;
+		expr += strcspn(expr, " \t\r");
+		if (*expr)
+			*expr++ = 0;
+		expr += strspn(expr, " \t\r");
+	}
+	if (strcmp(fmt, "text") == 0)
+		c->format = FMT_TEXT;
+	else if (strcmp(fmt, "json") == 0)
+		c->format = FMT_JSON;
+	else if (strcmp(fmt, "bin") == 0)
+		c->format = FMT_BIN;
+	else
+		return -1;
+	c->root = pid ? (pid_t)strnum(pid, &end, INT_MAX) : 1;
+	if (c->root < 1 || (pid && *end))
+		return -1;
+	if (*expr && !(c->filter = extrace_filter_new(tracer, expr, &errstr)))
+		return -1;
+	return 0;
+}
+
+static void
+client_read(struct client *c)
+{
+	char buf[256], *nl;
+	ssize_t n;
+
+	if ((n = read(c->fd, buf, sizeof buf)) <= 0) {
+		if (n == 0 || errno != EAGAIN)
+			client_close(c);
+		return;
+	}
+	if (c->format != -1)
+		return;  /* ignore anything after the request */
+
+	if (c->reqlen + n >= sizeof c->req) {
+		client_close(c);
+		return;
+	}
+	memcpy(c->req + c->reqlen, buf, n);
+	c->reqlen += n;
+	c->req[c->reqlen] = 0;
+	if (!(nl = strchr(c->req, '\n')))
+		return;
+	*nl = 0;
+	if (client_request(c) == -1) {
+		client_close(c);
+		return;
+	}
+	if (c->format == FMT_BIN) {
+		memcpy(c->ring, BIN_MAGIC, sizeof BIN_MAGIC - 1);
+		c->head = sizeof BIN_MAGIC - 1;
+	}
+}
+
+static void
+client_queue(struct client *c, const char *p, size_t n)
+{
+	size_t o, m;
+
+	if (c->head - c->tail + n > CLIENT_BUF) {
+		c->dropped++;
+		return;
+	}
+	o = c->head % CLIENT_BUF;
+	m = n < CLIENT_BUF - o ? n : CLIENT_BUF - o;
+	memcpy(c->ring + o, p, m);
+	memcpy(c->ring, p + m, n - m);
+	c->head += n;
+}
+
+/* write as much as the socket takes, returns -1 if c was closed.  */
+static int
+client_flush(struct client *c)
+{
+	struct kevent kev;
+	struct iovec iov[2];
+	size_t o, used;
+	ssize_t n;
+	int want;
+
+	while ((used = c->head - c->tail) > 0) {
+		o = c->tail % CLIENT_BUF;
+		iov[0].iov_base = c->ring + o;
+		iov[0].iov_len = used < CLIENT_BUF - o ? used : CLIENT_BUF - o;
+		iov[1].iov_base = c->ring;
+		iov[1].iov_len = used - iov[0].iov_len;
+		if ((n = writev(c->fd, iov, 2)) == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			client_close(c);
+			return -1;
+		}
+		c->tail += n;
+	}
+
+	want = c->head != c->tail;
+	if (want != c->want_write) {
+		EV_SET(&kev, c->fd, EVFILT_WRITE,
+		    want ? EV_ADD | EV_ENABLE : EV_DISABLE, 0, 0, 0);
+		kevent(kq, &kev, 1, 0, 0, 0);
+		c->want_write = want;
+	}
+	return 0;
+}
+
+static void
+clients_flush(void)
+{
+	struct client *c, *next;
+
+	for (c = clients; c; c = next) {
+		next = c->next;
+		if (c->head != c->tail && !c->want_write)
+			client_flush(c);
+	}
+}
+
+/* format ev once per format, and once per client with a subtree.  */
+static void
+serve_event(struct exec_event *ev)
+{
+	static struct buf cache[3];
+	static pid_t anc[MAXANC];
+	struct exec_event cev;
+	int have[3] = { 0, 0, 0 };
+	int nanc = -1, i;
+	struct client *c;
+	struct buf *b;
+
+	for (c = clients; c; c = c->next) {
+		if (c->format == -1)
+			continue;
+		if (c->filter && !extrace_match(tracer, c->filter))
+			continue;
+		if (c->root != 1) {
+			/* the ancestors are looked up once for all clients.  */
+			if (nanc < 0)
+				nanc = extrace_ancestors(tracer, ev->ppid, anc,
+				    MAXANC);
+			cev = *ev;
+			if (ev->pid == c->root) {
+				cev.depth = 0;
+			} else {
+				for (i = 0; i < nanc && anc[i] != c->root; i++)
+					;
+				if (i == nanc)
+					continue;
+				cev.depth = i + 1;
+			}
+			b = &obuf;
+			switch (c->format) {
+			case FMT_TEXT: format_text(b, &cev); break;
+			case FMT_BIN: format_bin(b, &cev, 0); break;
+			case FMT_JSON: format_json(b, &cev, 0); break;
+			}
+			client_queue(c, b->s, b->len);
+			b->len = 0;
+			continue;
+		}
+
+		b = &cache[c->format];
+		if (!have[c->format]) {
+			b->len = 0;
+			switch (c->format) {
+			case FMT_TEXT: format_text(b, ev); break;
+			case FMT_BIN: format_bin(b, ev, 0); break;
+			case FMT_JSON: format_json(b, ev, 0); break;
+			}
+			have[c->format] = 1;
+		}
+		client_queue(c, b->s, b->len);
+	}
+}
+
+static void
+serve_open(void)
+{
+	struct sockaddr_un sun;
+	struct kevent kev;
+
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	if (strlen(sockpath) >= sizeof sun.sun_path)
+		errx(1, "%s: socket path too long", sockpath);
+	strcpy(sun.sun_path, sockpath);
+
+	if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	unlink(sockpath);
+	if (bind(lfd, (struct sockaddr *)&sun, sizeof sun) == -1)
+		err(1, "%s", sockpath);
+	if (listen(lfd, 16) == -1)
+		err(1, "listen");
+	fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) | O_NONBLOCK);
+	signal(SIGPIPE, SIG_IGN);
+
+	EV_SET(&kev, lfd, EVFILT_READ, EV_ADD, 0, 0, 0);
+	if (kevent(kq, &kev, 1, 0, 0, 0) == -1)
+		err(1, "kevent");
+}
+
+/*
+ * Chrome trace events (-O chrome): a slice for each program, from its
+ * exec() until the next exec() or exit, written as a complete event
+ * when it ends.  A slice goes on the lane (tid) of its parent while the
+ * parent is the innermost slice there, so a process tree nests like a
+ * call stack; parallel children take the lowest free lane.  Only the
+ * slices of live processes are kept.
+ */
+#define SLICE_BUCKETS 1024
+
+struct slice {
+	pid_t pid;
+	int lane;
+	uint64_t start;
+	char *name;		/* JSON string */
+	char *args;		/* JSON members */
+	struct slice *below;	/* next inner slice of the lane */
+	struct slice *next;
+};
+
+static struct slice *stab[SLICE_BUCKETS];
+static struct slice **lanes;	/* innermost slice of each lane */
+static size_t nlanes;
+static uint64_t chrome_t0;	/* time of the first exec() */
+static uint64_t chrome_last;	/* of the last event */
+static unsigned long chrome_events;
+static struct buf sbuf;
+
+static struct slice **
+slice_find(pid_t pid)
+{
+	struct slice **sp;
+
+	for (sp = &stab[pid % SLICE_BUCKETS]; *sp; sp = &(*sp)->next)
+		if ((*sp)->pid == pid)
+			break;
+	return sp;
+}
+
+static void
+slice_end(struct slice *s, uint64_t end, const char *status)
+{
+	uint64_t ts = s->start - chrome_t0;
+	uint64_t dur = end > s->start ? end - s->start : 0;
+
+	buf_puts(&obuf, chrome_events++ ? ",\n" : "\n");
+	buf_printf(&obuf, "{\"name\":%s,\"ph\":\"X\",\"pid\":0,\"tid\":%d,"
+	    "\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,\"args\":{%s%s}}",
+	    s->name, s->lane,
+	    (unsigned long long)(ts / 1000), (unsigned long long)(ts % 1000),
+	    (unsigned long long)(dur / 1000), (unsigned long long)(dur % 1000),
+	    s->args, status);
+	free(s->name);
+	free(s->args);
+}
+
+static char *
+sbuf_dup(void)
+{
+	char *p;
+
+	if (!(p = malloc(sbuf.len + 1)))
+		err(1, "malloc");
+	memcpy(p, sbuf.s, sbuf.len);
+	p[sbuf.len] = 0;
+	sbuf.len = 0;
+	return p;
+}
+
+static void
+chrome_exec(struct exec_event *ev)
+{
+	struct slice *s, *p;
+	const char *exe, *base;
+	char **pp;
+	size_t i;
+
+	if (!chrome_t0)
+		chrome_t0 = ev->time;
+	chrome_last = ev->time;
+
+	if ((s = *slice_find(ev->pid))) {
+		/* exec() again, the new program keeps the place.  */
+		slice_end(s, ev->time, "");
+	} else {
+		if (!(s = calloc(1, sizeof *s)))
+			err(1, "calloc");
+		s->pid = ev->pid;
+		if ((p = *slice_find(ev->ppid)) && lanes[p->lane] == p) {
+			s->lane = p->lane;
+		} else {
+			for (i = 0; i < nlanes && lanes[i]; i++)
+				;
+			if (i == nlanes && !(lanes = realloc(lanes,
+			    ++nlanes * sizeof *lanes)))
+				err(1, "realloc");
+			lanes[i] = 0;
+			s->lane = i;
+		}
+		s->below = lanes[s->lane];
+		lanes[s->lane] = s;
+		s->next = stab[s->pid % SLICE_BUCKETS];
+		stab[s->pid % SLICE_BUCKETS] = s;
+	}
+	s->start = ev->time;
+
+	exe = ev->path ? ev->path : ev->argv[0] ? ev->argv[0] : "";
+	base = strrchr(exe, '/') ? strrchr(exe, '/') + 1 : exe;
+	print_json_str(&sbuf, base);
+	s->name = sbuf_dup();
+
+	buf_printf(&sbuf, "\"pid\":%d,\"ppid\":%d,", ev->pid, ev->ppid);
+	if (ev->depth >= 0)
+		buf_printf(&sbuf, "\"depth\":%d,", ev->depth);
+	buf_puts(&sbuf, "\"argv\":[");
+	for (pp = ev->argv; *pp; pp++) {
+		if (pp != ev->argv)
+			buf_putc(&sbuf, ',');
+		print_json_str(&sbuf, *pp);
+		if (!show_args)
+			break;
+	}
+	buf_putc(&sbuf, ']');
+	if (ev->flags & REC_CWD) {
+		buf_puts(&sbuf, ",\"cwd\":");
+		print_json_str(&sbuf, ev->cwd);
+	}
+	s->args = sbuf_dup();
+}
+
+static void
+chrome_exit(pid_t pid, int status, uint64_t time, void *arg)
+{
+	struct slice **sp, **lp, *s;
+	char st[32];
+
+	(void)arg;
+	if (!(s = *(sp = slice_find(pid))))
+		return;
+	chrome_last = time;
+	if (WIFSIGNALED(status))
+		snprintf(st, sizeof st, ",\"signal\":%d", WTERMSIG(status));
+	else
+		snprintf(st, sizeof st, ",\"exit\":%d", WEXITSTATUS(status));
+	slice_end(s, time, st);
+	out_write(obuf.s, obuf.len);
+	obuf.len = 0;
+
+	*sp = s->next;
+	for (lp = &lanes[s->lane]; *lp != s; lp = &(*lp)->below)
+		;
+	*lp = s->below;
+	free(s);
+}
+
+/* end the slices still running at the last event, and the array.  */
+static void
+chrome_finish(void)
+{
+	struct slice *s;
+	size_t i;
+
+	for (i = 0; i < SLICE_BUCKETS; i++)
+		while ((s = stab[i])) {
+			stab[i] = s->next;
+			slice_end(s, chrome_last, "");
+			free(s);
+		}
+	buf_puts(&obuf, "\n]\n");
+	out_write(obuf.s, obuf.len);
+	obuf.len = 0;
+	free(lanes);
+	free(sbuf.s);
+}
+
+/*
+ * Profile of the traced processes (-P), printed at exit.  A process
+ * runs itself only while it has no live children, its self time; the
+ * rest it waits.  A chain is a path of processes each ending before the
+ * next one ends, its length the sum of their self times.  A process
+ * starts after the longest chain of its siblings that ended before it,
+ * and ends after the longest chain of its children, or its start if it
+ * has none.  The longest chain of a top process is the critical path.
+ * Chains share their tails and are freed when no live process holds
+ * them, so only live processes and their current chains are kept.
+ * Time per program counts each exec() until the next exec() or exit.
+ */
+#define PROF_BUCKETS 1024
+#define PROF_TOP 10		/* programs listed */
+
+struct cpnode {
+	pid_t pid;
+	char *name;
+	uint64_t start;
+	uint64_t end;
+	uint64_t self;
+	uint64_t len;		/* of the chain up to its end */
+	struct cpnode *next;	/* rest of the chain */
+	int refs;
+};
+
+struct pproc {
+	pid_t pid;
+	pid_t ppid;
+	char *name;		/* of the program, or of the parent */
+	uint64_t start;		/* fork, or first exec() seen */
+	uint64_t exec;		/* of the program, 0 if none */
+	int children;		/* live ones */
+	uint64_t self;		/* time without live children */
+	uint64_t idle;		/* since when it has none */
+	struct cpnode *pred;	/* longest chain ended before its start */
+	struct cpnode *gate;	/* longest chain of its ended children */
+	struct frame *frame;	/* of the program, with -O folded */
+	struct pproc *next;
+};
+
+struct prog {
+	char *name;
+	unsigned long n;
+	uint64_t total;
+	uint64_t max;
+	struct prog *next;
+};
+
+static struct pproc *ptab[PROF_BUCKETS];
+static struct prog *progtab[PROF_BUCKETS];
+static size_t nprogs;
+static struct cpnode *critical;
+static uint64_t prof_first, prof_last;
+static uint64_t prof_busy;		/* sum of the self times */
+
+/*
+ * Concurrency (-C): the live processes and the leaves, those that
+ * called exec() and have no live children, integrated over each
+ * interval from the events.  A line is only written when the averages
+ * change.
+ */
+#define CONC_INTERVAL 10000000	/* ns */
+
+static const char *concfile;	/* -C */
+static FILE *concf;
+static size_t nlive, nleaves;
+static uint64_t conc_t;			/* integrated up to */
+static uint64_t conc_bucket;		/* start of the interval */
+static uint64_t conc_live, conc_leaves;	/* integrals over the interval */
+static uint64_t *conc_hist;		/* time spent with n leaves */
+static size_t conc_histn;
+static char conc_prev[64];
+
+static void
+conc_line(void)
+{
+	char line[64];
+
+	snprintf(line, sizeof line, "%.1f %.1f",
+	    (double)conc_live / CONC_INTERVAL,
+	    (double)conc_leaves / CONC_INTERVAL);
+	if (strcmp(line, conc_prev) == 0)
+		return;
+	fprintf(concf, "%llu %s\n",
+	    (unsigned long long)(conc_bucket - prof_first) / 1000000, line);
+	strcpy(conc_prev, line);
+}
+
+/* integrate the current counts up to t.  */
+static void
+conc_advance(uint64_t t)
+{
+	uint64_t end, d;
+
+	if (!conc_t) {
+		conc_t = conc_bucket = t;
+		return;
+	}
+	while (t > conc_t) {
+		end = conc_bucket + CONC_INTERVAL;
+		d = (t < end ? t : end) - conc_t;
+		conc_live += d * nlive;
+		conc_leaves += d * nleaves;
+		if (nleaves >= conc_histn) {
+			if (!(conc_hist = realloc(conc_hist,
+			    (nleaves + 1) * sizeof *conc_hist)))
+				err(1, "realloc");
+			memset(conc_hist + conc_histn, 0,
+			    (nleaves + 1 - conc_histn) * sizeof *conc_hist);
+			conc_histn = nleaves + 1;
+		}
+		conc_hist[nleaves] += d;
+		if ((conc_t += d) == end) {
+			conc_line();
+			conc_bucket = end;
+			conc_live = conc_leaves = 0;
+		}
+	}
+}
+
+/* the last partial interval, and the time spent at each parallelism.  */
+static void
+conc_finish(void)
+{
+	uint64_t total = 0;
+	size_t i;
+
+	if (conc_t > conc_bucket) {
+		conc_live = conc_live * CONC_INTERVAL / (conc_t - conc_bucket);
+		conc_leaves = conc_leaves * CONC_INTERVAL / (conc_t - conc_bucket);
+		conc_line();
+	}
+	if (fclose(concf) == EOF)
+		warn("%s", concfile);
+	for (i = 0; i < conc_histn; i++)
+		total += conc_hist[i];
+	if (total)
+		fprintf(stderr, "extrace: time with n leaves running:\n");
+	for (i = 0; i < conc_histn && total; i++)
+		if (conc_hist[i])
+			fprintf(stderr, "extrace:   %4zu %6.2f%% %10.3fms\n", i,
+			    100.0 * conc_hist[i] / total, conc_hist[i] / 1e6);
+	free(conc_hist);
+}
+
+/*
+ * Folded stacks (-O folded): a trie of the programs by ancestry, a
+ * program below its parent or below the program that called exec() to
+ * become it.  Each frame adds up the time its programs ran without live
+ * children, so that a stack only weighs its own time, and the stacks
+ * with time are written as "a;b;c us" every FOLD_INTERVAL and on exit,
+ * for flamegraph tools, which add up repeated stacks.
+ */
+#define FOLD_BUCKETS 4096
+#define FOLD_INTERVAL 60	/* seconds */
+
+struct frame {
+	struct frame *parent;
+	char *name;
+	uint32_t hash;
+	uint64_t weight;	/* ns since the last flush */
+	struct frame *next;
+};
+
+static struct frame *ftab[FOLD_BUCKETS];
+
+static struct frame *
+frame_get(struct frame *parent, const char *name)
+{
+	struct frame *f;
+	/* not from the address, so the stacks come out in the same order.  */
+	uint32_t h = hash_bytes(name, strlen(name)) ^
+	    (parent ? parent->hash * 31 : 0);
+	char *p;
+
+	for (f = ftab[h % FOLD_BUCKETS]; f; f = f->next)
+		if (f->hash == h && f->parent == parent &&
+		    strcmp(f->name, name) == 0)
+			return f;
+
+	if (!(f = calloc(1, sizeof *f)) || !(f->name = strdup(name)))
+		err(1, "calloc");
+	/* the separators of the folded format.  */
+	for (p = f->name; *p; p++)
+		if (*p == ';' || *p == '\n')
+			*p = '_';
+	f->parent = parent;
+	f->hash = h;
+	f->next = ftab[h % FOLD_BUCKETS];
+	ftab[h % FOLD_BUCKETS] = f;
+	return f;
+}
+
+static void
+frame_path(struct buf *b, struct frame *f)
+{
+	if (f->parent) {
+		frame_path(b, f->parent);
+		buf_putc(b, ';');
+	}
+	buf_puts(b, f->name);
+}
+
+/* write the stacks that ran for at least 1us since the last time.  */
+static void
+fold_flush(void)
+{
+	struct frame *f;
+	size_t i;
+
+	for (i = 0; i < FOLD_BUCKETS; i++)
+		for (f = ftab[i]; f; f = f->next) {
+			if (f->weight < 1000)
+				continue;
+			frame_path(&obuf, f);
+			buf_printf(&obuf, " %llu\n",
+			    (unsigned long long)f->weight / 1000);
+			f->weight %= 1000;
+			out_write(obuf.s, obuf.len);
+			obuf.len = 0;
+		}
+}
+
+static void
+fold_free(void)
+{
+	struct frame *f;
+	size_t i;
+
+	for (i = 0; i < FOLD_BUCKETS; i++)
+		while ((f = ftab[i])) {
+			ftab[i] = f->next;
+			free(f->name);
+			free(f);
+		}
+}
+
+static struct pproc **
+pproc_find(pid_t pid)
+{
+	struct pproc **pp;
+
+	for (pp = &ptab[pid % PROF_BUCKETS]; *pp; pp = &(*pp)->next)
+		if ((*pp)->pid == pid)
+			break;
+	return pp;
+}
+
+static void
+cp_unref(struct cpnode *c)
+{
+	struct cpnode *next;
+
+	for (; c && --c->refs == 0; c = next) {
+		next = c->next;
+		free(c->name);
+		free(c);
+	}
+}
+
+static void
+prof_time(uint64_t t)
+{
+	if (!prof_first)
+		prof_first = t;
+	if (t > prof_last)
+		prof_last = t;
+	if (concf)
+		conc_advance(t);
+}
+
+static void
+prog_add(const char *name, uint64_t t)
+{
+	struct prog *g;
+	uint32_t h = hash_bytes(name, strlen(name));
+
+	for (g = progtab[h % PROF_BUCKETS]; g; g = g->next)
+		if (strcmp(g->name, name) == 0)
+			break;
+	if (!g) {
+		if (!(g = calloc(1, sizeof *g)) || !(g->name = strdup(name)))
+			err(1, "calloc");
+		g->next = progtab[h % PROF_BUCKETS];
+		progtab[h % PROF_BUCKETS] = g;
+		nprogs++;
+	}
+	g->n++;
+	g->total += t;
+	if (t > g->max)
+		g->max = t;
+}
+
+/* p ran without live children until t.  */
+static void
+pproc_self(struct pproc *p, uint64_t t)
+{
+	p->self += t - p->idle;
+	if (p->frame)
+		p->frame->weight += t - p->idle;
+	p->idle = t;
+}
+
+static struct pproc *
+pproc_new(pid_t pid, pid_t ppid, uint64_t t)
+{
+	struct pproc *p, *parent = *pproc_find(ppid);
+
+	if (!(p = calloc(1, sizeof *p)))
+		err(1, "calloc");
+	p->pid = pid;
+	p->ppid = ppid;
+	p->start = p->idle = t;
+	if (!(p->name = strdup(parent ? parent->name : "?")))
+		err(1, "strdup");
+	if (parent && parent->children++ == 0) {
+		pproc_self(parent, t);
+		if (parent->exec)
+			nleaves--;
+	}
+	if (parent) {
+		p->frame = parent->frame;
+		if ((p->pred = parent->gate ? parent->gate : parent->pred))
+			p->pred->refs++;
+	}
+	nlive++;
+	p->next = ptab[pid % PROF_BUCKETS];
+	ptab[pid % PROF_BUCKETS] = p;
+	return p;
+}
+
+static void
+prof_fork(pid_t pid, pid_t ppid, uint64_t t, void *arg)
+{
+	(void)arg;
+	prof_time(t);
+	if (!*pproc_find(pid))
+		pproc_new(pid, ppid, t);
+}
+
+static void
+prof_exec(struct exec_event *ev)
+{
+	struct pproc *p;
+	const char *exe;
+
+	prof_time(ev->time);
+	if (!(p = *pproc_find(ev->pid)))
+		p = pproc_new(ev->pid, ev->ppid, ev->time);
+	if (p->exec)
+		prog_add(p->name, ev->time - p->exec);
+	else if (!p->children)
+		nleaves++;
+	if (!p->children)
+		pproc_self(p, ev->time);
+	p->exec = ev->time;
+	exe = ev->path ? ev->path : ev->argv[0] ? ev->argv[0] : "?";
+	free(p->name);
+	if (!(p->name = strdup(strrchr(exe, '/') ? strrchr(exe, '/') + 1 : exe)))
+		err(1, "strdup");
+	if (format == FMT_FOLDED)
+		p->frame = frame_get(p->frame, p->name);
+}
+
+static void
+prof_exit(pid_t pid, int status, uint64_t t, void *arg)
+{
+	struct pproc **pp, *p, *parent;
+	struct cpnode *c, **best;
+
+	(void)status, (void)arg;
+	if (!(p = *(pp = pproc_find(pid))))
+		return;
+	prof_time(t);
+	if (p->exec)
+		prog_add(p->name, t - p->exec);
+	if (!p->children) {
+		pproc_self(p, t);
+		if (p->exec)
+			nleaves--;
+	}
+	prof_busy += p->self;
+	nlive--;
+	*pp = p->next;
+
+	if (!(c = malloc(sizeof *c)))
+		err(1, "malloc");
+	c->pid = pid;
+	c->name = p->name;
+	c->start = p->start;
+	c->end = t;
+	c->self = p->self;
+	if (p->gate) {
+		c->next = p->gate;
+		cp_unref(p->pred);
+	} else {
+		c->next = p->pred;
+	}
+	c->len = c->self + (c->next ? c->next->len : 0);
+	c->refs = 1;
+	if ((parent = *pproc_find(p->ppid))) {
+		if (--parent->children == 0) {
+			parent->idle = t;
+			if (parent->exec)
+				nleaves++;
+		}
+		best = &parent->gate;
+	} else {
+		best = &critical;
+	}
+	if (*best && (*best)->len >= c->len)
+		best = 0;
+	if (best) {
+		cp_unref(*best);
+		*best = c;
+	} else {
+		cp_unref(c);
+	}
+	free(p);
+}
+
+static int
+prog_cmp(const void *a, const void *b)
+{
+	const struct prog *ga = *(struct prog * const *)a;
+	const struct prog *gb = *(struct prog * const *)b;
+
+	return ga->total < gb->total ? 1 : ga->total > gb->total ? -1 : 0;
+}
+
+/* end the processes still running at the last event, leaves first.  */
+static void
+prof_end(void)
+{
+	struct pproc *p;
+	size_t i;
+	int done;
+
+	do {
+		done = 0;
+		for (i = 0; i < PROF_BUCKETS; i++)
+			for (p = ptab[i]; p; p = p->next)
+				if (!p->children) {
+					prof_exit(p->pid, 0, prof_last, 0);
+					done++;
+					break;
+				}
+	} while (done);
+}
+
+static void
+print_profile(void)
+{
+	struct prog **v, *g;
+	struct cpnode *c;
+	uint64_t wall;
+	size_t i, n;
+
+	if (critical) {
+		for (n = 0, c = critical; c; c = c->next)
+			n++;
+		fprintf(stderr, "extrace: critical path: %zu processes, "
+		    "%.3fms\n", n, critical->len / 1e6);
+		for (c = critical; c; c = c->next)
+			fprintf(stderr, "extrace:   %10.3fms %10.3fms self  %d %s\n",
+			    (c->end - c->start) / 1e6, c->self / 1e6, c->pid,
+			    c->name);
+	}
+
+	if (!(v = calloc(nprogs + 1, sizeof *v)))
+		err(1, "calloc");
+	for (n = 0, i = 0; i < PROF_BUCKETS; i++)
+		for (g = progtab[i]; g; g = g->next)
+			v[n++] = g;
+	qsort(v, n, sizeof *v, prog_cmp);
+	if (n)
+		fprintf(stderr, "extrace: time per program, %zu programs:\n", n);
+	for (i = 0; i < n && i < PROF_TOP; i++)
+		fprintf(stderr, "extrace:   %10.3fms %6lu runs %10.3fms max  %s\n",
+		    v[i]->total / 1e6, v[i]->n, v[i]->max / 1e6, v[i]->name);
+	for (i = 0; i < n; i++) {
+		free(v[i]->name);
+		free(v[i]);
+	}
+	free(v);
+
+	wall = prof_last - prof_first;
+	fprintf(stderr, "extrace: parallelism: %.2f on average over %.3fms\n",
+	    wall ? (double)prof_busy / wall : 0.0, wall / 1e6);
+	cp_unref(critical);
+}
+
+/*
+ * Compilation database (-O compdb): each compiler run that is not only
+ * preprocessing becomes an entry for each of its source files, with
+ * the cwd as directory.  Entries are written as they come, the first
+ * one for an output file in a directory wins.
+ */
+#define COMPDB_BUCKETS 4096
+
+static const struct {
+	const char *name;
+	int versioned;		/* may have a suffix like 12 or -16 */
+} compilers[] = {
+	{ "cc", 0 }, { "c++", 0 },
+	{ "gcc", 1 }, { "g++", 1 }, { "clang", 1 }, { "clang++", 1 },
+};
+
+static const char *srcexts[] = {
+	"c", "C", "cc", "cp", "cpp", "CPP", "cxx", "c++", "m", "mm", "M",
+	"S", "cu", 0
+};
+
+/* options whose value is the next argument.  */
+static const char *argopts[] = {
+	"-o", "-I", "-D", "-U", "-x", "-MF", "-MT", "-MQ", "-include",
+	"-imacros", "-isystem", "-idirafter", "-iquote", "-isysroot",
+	"-arch", "-target", "-Xclang", "-Xlinker", "-Xpreprocessor",
+	"-Xassembler", "--param", 0
+};
+
+struct cdkey {
+	uint32_t hash;
+	size_t len;
+	char *key;		/* directory, NUL, output */
+	struct cdkey *next;
+};
+
+static const char **extra_compilers;	/* -K */
+static size_t nextra_compilers;
+static struct cdkey *cdtab[COMPDB_BUCKETS];
+static unsigned long compdb_entries;
+
+/*
+ * cc, gcc12, clang++-16 or x86_64-unknown-freebsd14.0-gcc, but not
+ * cc1 of gcc, or a name given with -K.
+ */
+static int
+is_compiler(const char *name)
+{
+	const char *p;
+	size_t i, n;
+
+	for (i = 0; i < nextra_compilers; i++)
+		if (strcmp(name, extra_compilers[i]) == 0)
+			return 1;
+	for (;;) {
+		for (i = 0; i < sizeof compilers / sizeof compilers[0]; i++) {
+			n = strlen(compilers[i].name);
+			if (strncmp(name, compilers[i].name, n) != 0)
+				continue;
+			if (!name[n] || (compilers[i].versioned &&
+			    !name[n + strspn(name + n, "0123456789.-")]))
+				return 1;
+		}
+		/* skip a target prefix.  */
+		if (!(p = strchr(name, '-')))
+			return 0;
+		name = p + 1;
+	}
+}
+
+static int
+is_source(const char *s)
+{
+	const char *dot = strrchr(s, '.');
+	int i;
+
+	if (!dot || *s == '-')
+		return 0;
+	for (i = 0; srcexts[i]; i++)
+		if (strcmp(dot + 1, srcexts[i]) == 0)
+			return 1;
+	return 0;
+}
+
+static int
+has_argopt(const char *s)
+{
+	int i;
+
+	for (i = 0; argopts[i]; i++)
+		if (strcmp(s, argopts[i]) == 0)
+			return 1;
+	return 0;
+}
+
+/* return 1 the first time output is seen in dir.  */
+static int
+compdb_new(const char *dir, const char *output)
+{
+	struct cdkey *k;
+	size_t dl = strlen(dir) + 1, ol = strlen(output);
+	uint32_t h = hash_bytes(dir, dl - 1) ^ hash_bytes(output, ol);
+
+	for (k = cdtab[h % COMPDB_BUCKETS]; k; k = k->next)
+		if (k->hash == h && k->len == dl + ol &&
+		    memcmp(k->key, dir, dl) == 0 &&
+		    memcmp(k->key + dl, output, ol) == 0)
+			return 0;
+
+	if (!(k = malloc(sizeof *k)) || !(k->key = malloc(dl + ol)))
+		err(1, "malloc");
+	memcpy(k->key, dir, dl);
+	memcpy(k->key + dl, output, ol);
+	k->hash = h;
+	k->len = dl + ol;
+	k->next = cdtab[h % COMPDB_BUCKETS];
+	cdtab[h % COMPDB_BUCKETS] = k;
+	return 1;
+}
+
+static void
+compdb_exec(struct exec_event *ev)
+{
+	const char *exe, *output = 0, *src;
+	char obj[PATH_MAX], *dot;
+	char **pp, **sp;
+	int compile = 0, nsrc = 0;
+
+	if (!ev->cwd || !ev->argv[0])
+		return;
+	exe = strrchr(ev->argv[0], '/') ? strrchr(ev->argv[0], '/') + 1 :
+	    ev->argv[0];
+	if (!is_compiler(exe))
+		return;
+
+	for (pp = ev->argv + 1; *pp; pp++) {
+		if (strcmp(*pp, "-E") == 0 || strcmp(*pp, "-M") == 0 ||
+		    strcmp(*pp, "-MM") == 0)
+			return;
+		if (strcmp(*pp, "-c") == 0 || strcmp(*pp, "-S") == 0)
+			compile = 1;
+		if (strcmp(*pp, "-o") == 0 && pp[1])
+			output = pp[1];
+		else if (strncmp(*pp, "-o", 2) == 0 && (*pp)[2])
+			output = *pp + 2;
+		if (has_argopt(*pp) && pp[1])
+			pp++;
+		else if (is_source(*pp))
+			nsrc++;
+	}
+
+	for (sp = ev->argv + 1; *sp; sp++) {
+		if (has_argopt(*sp) && sp[1]) {
+			sp++;
+			continue;
+		}
+		if (!is_source(*sp))
+			continue;
+		src = *sp;
+		if (nsrc > 1 || !output) {
+			/* the object in the cwd, as the compiler names it.  */
+			if (!compile)
+				output = 0;
+			else {
+				snprintf(obj, sizeof obj, "%s", strrchr(src, '/') ?
+				    strrchr(src, '/') + 1 : src);
+				if ((dot = strrchr(obj, '.')))
+					strcpy(dot, ".o");
+				output = obj;
+			}
+		}
+		if (!compdb_new(ev->cwd, output ? output : src))
+			continue;
+
+		buf_puts(&obuf, compdb_entries++ ? ",\n" : "\n");
+		buf_puts(&obuf, "{\"directory\":");
+		print_json_str(&obuf, ev->cwd);
+		buf_puts(&obuf, ",\"arguments\":[");
+		for (pp = ev->argv; *pp; pp++) {
+			if (pp != ev->argv)
+				buf_putc(&obuf, ',');
+			print_json_str(&obuf, *pp);
+		}
+		buf_puts(&obuf, "],\"file\":");
+		print_json_str(&obuf, src);
+		if (output) {
+			buf_puts(&obuf, ",\"output\":");
+			print_json_str(&obuf, output);
+		}
+		buf_putc(&obuf, '}');
+	}
+}
+
+static void
+compdb_finish(void)
+{
+	struct cdkey *k;
+	size_t i;
+
+	out_write("\n]\n", 3);
+	for (i = 0; i < COMPDB_BUCKETS; i++)
+		while ((k = cdtab[i])) {
+			cdtab[i] = k->next;
+			free(k->key);
+			free(k);
+		}
+}
+
+static void
+exited(pid_t pid, int status, uint64_t t, void *arg)
+{
+	if (format == FMT_CHROME)
+		chrome_exit(pid, status, t, arg);
+	if (proctree)
+		prof_exit(pid, status, t, arg);
+}
+
+static void
+emit(struct exec_event *ev, void *arg)
+{
+	struct irefs irefs, *ir = 0;
+	uint64_t t0, t1;
+	size_t len;
 
-static FILE *output;
-static pid_t parent = 1;
-static int flat = 0;
-static int full_path = 0;
-static int show_args = 1;
-static int show_cwd = 0;
-static int show_env = 0;
+	(void)arg;
+	if (proctree) {
+		t0 = mono_ns();
+		prof_exec(ev);
+		extrace_hist_add(&t_prof, mono_ns() - t0);
+	}
+	if (sockpath) {
+		t0 = mono_ns();
+		serve_event(ev);
+		extrace_hist_add(&t_serve, mono_ns() - t0);
+		if (!outfile)
+			return;
+	}
 
-static kvm_t *kd;
-static int kq;
-static int quit = 0;
+	if (rotate_size && outbytes >= rotate_size)
+		rotate();
+
+	if (intern && (format == FMT_BIN || format == FMT_JSON)) {
+		t0 = mono_ns();
+		ir = &irefs;
+		intern_event(&obuf, ev, ir);
+		extrace_hist_add(&t_intern, mono_ns() - t0);
+	}
+
+	/* only the formatter, the definitions are counted by intern.  */
+	t0 = mono_ns();
+	len = obuf.len;
+	switch (format) {
+	case FMT_TEXT: format_text(&obuf, ev); break;
+	case FMT_BIN: format_bin(&obuf, ev, ir); break;
+	case FMT_JSON: format_json(&obuf, ev, ir); break;
+	case FMT_CHROME: chrome_exec(ev); break;
+	case FMT_FOLDED: break;
+	case FMT_COMPDB: compdb_exec(ev); break;
+	}
+	t1 = mono_ns();
+	extrace_hist_add(&t_format, t1 - t0);
+	t_bytes += obuf.len - len;
+	out_write(obuf.s, obuf.len);
+	obuf.len = 0;
+	extrace_hist_add(&t_write, mono_ns() - t1);
+}
+
+static void
+print_env_stats(void)
+{
+	struct extrace_stats st;
+
+	extrace_stats(tracer, &st);
+	fprintf(stderr, "extrace: environments: %zu processes, %zu sets, "
+	    "%zu bytes (peak %zu, limit %zu), %lu not kept\n",
+	    st.procs, st.envsets, st.envbytes, st.envbytes_max,
+	    st.envbytes_limit, st.envsets_dropped);
+}
 
 static int
-pid_depth(pid_t pid)
+get_var(FILE *f, uint64_t *v)
 {
-	struct kinfo_proc *kp;
-	pid_t ppid = 0;
-	int d;
-	int n;
+	int c, shift = 0;
 
-	kp = kvm_getprocs(kd, KERN_PROC_PID, pid, &n);
-	if (!kp) {
-		fprintf(stderr, "extrace: kvm_getprocs: %s\n", kvm_geterr(kd));
-		return -1;
+	*v = 0;
+	do {
+		if ((c = getc(f)) == EOF || shift > 63)
+			return -1;
+		*v |= (uint64_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return 0;
+}
+
+/* cursor over one record body read by decode().  */
+struct rec {
+	unsigned char *p;
+	unsigned char *end;
+	int bad;
+};
+
+static uint64_t
+rec_var(struct rec *r)
+{
+	uint64_t v = 0;
+	int shift = 0;
+
+	do {
+		if (r->p == r->end || shift > 63) {
+			r->bad = 1;
+			return 0;
+		}
+		v |= (uint64_t)(*r->p & 0x7f) << shift;
+		shift += 7;
+	} while (*r->p++ & 0x80);
+	return v;
+}
+
+/* strings are NUL-terminated in place by shifting them down one byte.  */
+static char *
+rec_str(struct rec *r)
+{
+	uint64_t n = rec_var(r);
+	unsigned char *s;
+
+	if (r->bad || n == 0)
+		return 0;
+	n--;
+	if (n > (uint64_t)(r->end - r->p)) {
+		r->bad = 1;
+		return 0;
 	}
-	ppid = kp->ki_ppid;
+	s = r->p - 1;
+	memmove(s, r->p, n);
+	s[n] = 0;
+	r->p += n;
+	return (char *)s;
+}
 
-	if (pid == parent)
+/* read strings into (*v)[off...].  */
+static char **
+rec_strv(struct rec *r, char ***v, size_t *vcap, size_t off)
+{
+	uint64_t n = rec_var(r), i;
+
+	if (r->bad || n == 0)
 		return 0;
+	n--;
+	if (n > (uint64_t)(r->end - r->p)) {
+		r->bad = 1;
+		return 0;
+	}
+	if (off + n + 1 > *vcap) {
+		*vcap = off + n + 1;
+		if (!(*v = realloc(*v, *vcap * sizeof (char *))))
+			err(1, "realloc");
+	}
+	for (i = 0; i < n; i++)
+		if (!((*v)[off+i] = rec_str(r)) && !r->bad)
+			(*v)[off+i] = (char *)"";
+	(*v)[off+n] = 0;
+	return *v;
+}
 
-	if (ppid == parent)
-		return 1;
+/* definitions seen by the decoder, indexed by id.  */
+static struct buf *defs;
+static size_t ndefs;
 
-	if (ppid == 0)
-		return -1;  /* a parent we are not interested in */
+static void
+rec_def(struct rec *r)
+{
+	static char **v;
+	static size_t vcap;
+	uint64_t id = rec_var(r);
+	char *s;
+	int kind;
 
-	d = pid_depth(ppid);
-	if (d == -1)
-		return -1;
+	if (r->bad || r->p == r->end || id >= INTERN_MAX) {
+		r->bad = 1;
+		return;
+	}
+	kind = *r->p++;
+	if (id >= ndefs) {
+		if (!(defs = realloc(defs, (id + 1) * sizeof *defs)))
+			err(1, "realloc");
+		memset(defs + ndefs, 0, (id + 1 - ndefs) * sizeof *defs);
+		ndefs = id + 1;
+	}
+	if (kind == INTERN_STR) {
+		if (vcap < 2 && !(v = realloc(v, (vcap = 2) * sizeof *v)))
+			err(1, "realloc");
+		if ((s = rec_str(r))) {
+			v[0] = s;
+			v[1] = 0;
+			save_strv(&defs[id], v);
+		}
+	} else if (rec_strv(r, &v, &vcap, 0)) {
+		save_strv(&defs[id], v);
+	}
+}
+
+static char **
+rec_ref(struct rec *r)
+{
+	uint64_t ref = rec_var(r);
+
+	if (r->bad || ref == 0)
+		return 0;
+	if (ref > ndefs || !defs[ref-1].s) {
+		r->bad = 1;
+		return 0;
+	}
+	return (char **)defs[ref-1].s;
+}
+
+static int
+strv_len(char **v)
+{
+	int n = 0;
+
+	if (v)
+		while (v[n])
+			n++;
+	return n;
+}
+
+static int
+rec_event(struct rec *r, struct exec_event *ev)
+{
+	static char **argv, **envp, **unset, **tags;
+	static size_t argvcap, envpcap, unsetcap, tagscap;
+	char **v;
+
+	memset(ev, 0, sizeof *ev);
+	ev->flags = rec_var(r);
+	ev->time = rec_var(r);
+	ev->pid = rec_var(r);
+	ev->ppid = rec_var(r);
+	ev->depth = (int)rec_var(r) - 1;
+	if (ev->flags & REC_INTERN) {
+		if (ev->flags & REC_CWD && (v = rec_ref(r)))
+			ev->cwd = v[0];
+		if (ev->flags & REC_PATH && (v = rec_ref(r)))
+			ev->path = v[0];
+		/* argv[0] is only missing for an empty argv.  */
+		v = rec_ref(r);
+		if ((ev->argv = rec_strv(r, &argv, &argvcap, 1))) {
+			if (!v && ev->argv[1])
+				r->bad = 1;
+			ev->argv[0] = v ? v[0] : 0;
+		}
+		if (ev->flags & REC_ENV)
+			ev->envp = rec_ref(r);
+	} else {
+		if (ev->flags & REC_CWD)
+			ev->cwd = rec_str(r);
+		if (ev->flags & REC_PATH)
+			ev->path = rec_str(r);
+		ev->argv = rec_strv(r, &argv, &argvcap, 0);
+		if (ev->flags & REC_ENV)
+			ev->envp = rec_strv(r, &envp, &envpcap, 0);
+	}
+	if (ev->flags & REC_ENVDIFF)
+		ev->unset = rec_strv(r, &unset, &unsetcap, 0);
+	if (ev->flags & REC_TAGS)
+		ev->tags = rec_strv(r, &tags, &tagscap, 0);
+	ev->flags &= ~REC_INTERN;
+	ev->argc = strv_len(ev->argv);
+	ev->envc = strv_len(ev->envp);
+	ev->unsetc = strv_len(ev->unset);
+	ev->tagc = strv_len(ev->tags);
+	return r->bad || !ev->argv ? -1 : 0;
+}
+
+/* decode and emit the record body p, returns 1 if ev was filled.  */
+static int
+decode_record(char *p, size_t len, const char *file, struct exec_event *ev)
+{
+	struct rec r;
+	int ret = 0;
+
+	r.p = (unsigned char *)p;
+	r.end = r.p + len;
+	r.bad = 0;
+	if (len == 0)
+		return 0;
+
+	switch (*r.p++) {
+	case REC_EXEC:
+		if (rec_event(&r, ev) == 0) {
+			emit(ev, 0);
+			ret = 1;
+		}
+		break;
+	case REC_DEF:
+		rec_def(&r);
+		break;
+	default:
+		return 0;  /* unknown record types are skipped */
+	}
+	if (r.bad)
+		warnx("%s: malformed record", file);
+	return ret;
+}
 
-	return d+1;
+static void
+decode_records(FILE *f, const char *file)
+{
+	struct buf rbuf = { 0 };
+	struct exec_event ev;
+	uint64_t len;
+
+	while (get_var(f, &len) == 0) {
+		rbuf.len = 0;
+		buf_grow(&rbuf, len);
+		if (fread(rbuf.s, 1, len, f) != len) {
+			warnx("%s: truncated record", file);
+			break;
+		}
+		decode_record(rbuf.s, len, file, &ev);
+	}
+
+	free(rbuf.s);
 }
 
+/* print a histogram of nanoseconds in microseconds.  */
 static void
-print_shquoted(const char *s)
+hist_print(const char *name, const struct extrace_hist *h)
 {
-	if (*s && !strpbrk(s,
-	    "\001\002\003\004\005\006\007\010"
-	    "\011\012\013\014\015\016\017\020"
-	    "\021\022\023\024\025\026\027\030"
-	    "\031\032\033\034\035\036\037\040"
-	    "`^#*[]=|\\?${}()'\"<>&;\177")) {
-		fprintf(output, "%s", s);
+	if (!h->n)
 		return;
+	fprintf(stderr, "extrace: %s: n=%llu mean=%.1fus p50=%.1fus "
+	    "p90=%.1fus p99=%.1fus max=%.1fus\n", name,
+	    (unsigned long long)h->n, h->sum / 1e3 / h->n,
+	    extrace_hist_pct(h, 0.5) / 1e3, extrace_hist_pct(h, 0.9) / 1e3,
+	    extrace_hist_pct(h, 0.99) / 1e3, h->max / 1e3);
+}
+
+/* counters since the start, and where the time per exec() goes.  */
+static void
+print_timing(void)
+{
+	static const char *names[EXTRACE_T_MAX] = {
+		"kinfo", "tree", "path", "argv", "cwd", "env", "output", "exec",
+	};
+	struct extrace_stats st;
+	struct extrace_hist h;
+	struct client *c;
+	unsigned long dropped = ring_dropped + cdropped + clients_dropped;
+	double secs = (mono_ns() - t_start) / 1e9;
+	int i;
+
+	for (c = clients; c; c = c->next)
+		dropped += c->dropped;
+	extrace_stats(tracer, &st);
+	fprintf(stderr, "extrace: %lu execs in %.1fs (%.1f/s), %lu races, "
+	    "%lu filtered, %lu suppressed, %lu sampled, %lu dropped\n",
+	    st.events, secs, secs > 0 ? st.events / secs : 0.0, st.races,
+	    st.filtered, st.suppressed, st.sampled, dropped);
+	for (i = 0; i < EXTRACE_T_MAX; i++) {
+		extrace_timing(tracer, i, &h);
+		hist_print(names[i], &h);
 	}
+	hist_print("profile", &t_prof);
+	hist_print("serve", &t_serve);
+	hist_print("intern", &t_intern);
+	hist_print("format", &t_format);
+	if (t_bytes)
+		fprintf(stderr, "extrace: format: %.2fns/byte, %.0f bytes/exec\n",
+		    (double)t_format.sum / t_bytes, (double)t_bytes / t_format.n);
+	hist_print("write", &t_write);
+	hist_print("flush", &t_flush);
+	if (compress_method)
+		print_compress_stats();
+}
 
-	putc('\'', output);
-	for (; *s; s++)
-		if (*s == '\'')
-			fprintf(output, "'\\''");
-		else if (*s == '\n')
-			fprintf(output, "'$'\\n''");
-		else
-			putc(*s, output);
-	putc('\'', output);
+/*
+ * Handle the events still queued when cmd exits, the last exits among
+ * them.  extrace_dispatch() only counts execs, so poll for more.
+ */
+static void
+drain(void)
+{
+	struct pollfd pfd;
+
+	pfd.fd = extrace_fd(tracer);
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, 0) > 0)
+		if (extrace_dispatch(tracer, 0) == -1)
+			err(1, "extrace_dispatch");
 }
 
 static void
-handle_msg(pid_t pid)
+stop(int sig)
 {
-	char **pp;
-	struct kinfo_proc *kp;
+	(void)sig;
+	quit = 1;
+}
+
+/* follow the shared memory ring name until interrupted.  */
+static void
+decode_shm(const char *name)
+{
+	struct ring_reader rd;
+	struct extrace_hist lat = { 0 };
+	struct buf rbuf = { 0 };
+	struct exec_event ev;
+	uint64_t len, now;
+	long n;
+	int i, idle = 0;
 
-	int d, n;
+	if (ring_attach(&rd, name, 0) == -1)
+		err(1, "%s", name);
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+	buf_grow(&rbuf, rd.ring->size);
 
-	if (!flat) {
-		d = pid_depth(pid);
-		if (d < 0)
-			return;
-		fprintf(output, "%*s", 2*d, "");
+	while (!quit) {
+		if ((n = ring_read(&rd, rbuf.s, rbuf.cap)) == 0) {
+			fflush(output);
+			/* spin briefly, then back off to 1ms polls.  */
+			if (++idle > 1000)
+				usleep(1000);
+			continue;
+		}
+		idle = 0;
+		if (n < 0)
+			continue;
+		for (len = 0, i = 0; rbuf.s[i] & 0x80; i++)
+			len |= (uint64_t)(rbuf.s[i] & 0x7f) << (7*i);
+		len |= (uint64_t)(rbuf.s[i] & 0x7f) << (7*i);
+		i++;
+		if (decode_record(rbuf.s + i, len, name, &ev)) {
+			now = now_ns();
+			extrace_hist_add(&lat, now > ev.time ? now - ev.time : 0);
+		}
 	}
-	fprintf(output, "%d ", pid);
 
-	if (show_cwd) {
-		int name[] = { CTL_KERN, KERN_PROC, KERN_PROC_CWD, pid };
-		struct kinfo_file info;
-		size_t len = sizeof info;
-		if (sysctl(name, 4, &info, &len, 0, 0) != 1)
-			print_shquoted(info.kf_path);
-		else
-			fprintf(output, "?");
-		fprintf(output, " %% ");
-	}
-
-	kp = kvm_getprocs(kd, KERN_PROC_PID, pid, &n);
-	if (!kp)
-		err(1, "kvm_getprocs");
-	pp = kvm_getargv(kd, kp, 0);
-	if (!pp)
-		err(1, "kvm_getargv");
-
-	if (full_path) {
-		int name[] = { CTL_KERN, KERN_PROC, KERN_PROC_PATHNAME, pid };
-		char path[PATH_MAX];
-		size_t len = sizeof path;
-		if (sysctl(name, 4, &path, &len, 0, 0) != 1)
-			print_shquoted(path);
-		else
-			print_shquoted(*pp);
-		pp++;
+	fflush(output);
+	hist_print("latency", &lat);
+	if (rd.lost)
+		fprintf(stderr, "extrace: %llu bytes overrun\n",
+		    (unsigned long long)rd.lost);
+	free(rbuf.s);
+}
+
+/* linearize the records of a ring file and decode them.  */
+static void
+decode_ring(FILE *f, const char *file)
+{
+	struct ring hdr;
+	char *data, *lin;
+	uint64_t used, o;
+	FILE *m;
+
+	memcpy(hdr.magic, RING_MAGIC, sizeof hdr.magic);
+	if (fread((char *)&hdr + sizeof hdr.magic, 1,
+	    sizeof hdr - sizeof hdr.magic, f) != sizeof hdr - sizeof hdr.magic)
+		errx(1, "%s: truncated ring header", file);
+	if (hdr.head < hdr.tail || hdr.head - hdr.tail > hdr.size)
+		errx(1, "%s: corrupt ring header", file);
+	if (hdr.gen & 1)
+		warnx("%s: last update incomplete, ignoring it", file);
+
+	if (!(data = malloc(hdr.size)) || !(lin = malloc(hdr.size + 1)))
+		err(1, "malloc");
+	if (fread(data, 1, hdr.size, f) != hdr.size)
+		errx(1, "%s: truncated ring", file);
+	used = hdr.head - hdr.tail;
+	o = hdr.tail % hdr.size;
+	if (o + used <= hdr.size) {
+		memcpy(lin, data + o, used);
 	} else {
-		print_shquoted(*pp++);
+		memcpy(lin, data + o, hdr.size - o);
+		memcpy(lin + hdr.size - o, data, used - (hdr.size - o));
 	}
 
-	if (show_args)
-		for (; *pp; pp++) {
-			putc(' ', output);
-			print_shquoted(*pp);
-		}
+	if (used && (m = fmemopen(lin, used, "r"))) {
+		decode_records(m, file);
+		fclose(m);
+	}
+	free(data);
+	free(lin);
+}
 
-	if (show_env) {
-		char *eq;
-		pp = kvm_getenvv(kd, kp, 0);
-		if (pp) {
-			for (; *pp; pp++) {
-				putc(' ', output);
-				if ((eq = strchr(*pp, '='))) {
-					/* print split so = doesn't trigger escaping.  */
-					*eq = 0;
-					print_shquoted(*pp);
-					putc('=', output);
-					print_shquoted(eq+1);
-				} else {
-					/* weird env entry without equal sign.  */
-					print_shquoted(*pp);
-				
-				}
-			}
-		} else {
-			fprintf(output, " -");
-		}
+static int
+decode(const char *file)
+{
+	char magic[sizeof BIN_MAGIC - 1];
+	FILE *f;
+
+	if (strncmp(file, "shm:", 4) == 0) {
+		decode_shm(file + 4);
+		return 0;
 	}
 
-	fprintf(output, "\n");
-	fflush(output);
+	if (strcmp(file, "-") == 0)
+		f = stdin;
+	else if (!(f = fopen(file, "r")))
+		err(1, "%s", file);
+
+	if (fread(magic, 1, sizeof magic, f) != sizeof magic)
+		errx(1, "%s: not an extrace binary trace", file);
+	if (memcmp(magic, RING_MAGIC, sizeof magic) == 0)
+		decode_ring(f, file);
+	else if (memcmp(magic, BIN_MAGIC, sizeof magic) == 0)
+		decode_records(f, file);
+	else
+		errx(1, "%s: not an extrace binary trace", file);
+
+	if (f != stdin)
+		fclose(f);
+	return 0;
+}
+
+static void
+add_pid(pid_t **v, size_t *n, const char *s)
+{
+	pid_t pid;
+	char *end;
+
+	if (!(pid = strnum(s, &end, INT_MAX)) || *end)
+		errx(1, "invalid pid: %s", s);
+	if (!(*v = realloc(*v, (*n + 1) * sizeof **v)))
+		err(1, "realloc");
+	(*v)[(*n)++] = pid;
+}
+
+static int
+is_pipe(int fd)
+{
+	struct stat st;
+
+	return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+/* parse a size with optional k, m or g suffix.  */
+static size_t
+parse_size(const char *s)
+{
+	char *end;
+	size_t n = strnum(s, &end, SIZE_MAX);
+	int shift = 0;
+
+	switch (*end) {
+	case 'g': case 'G': shift += 10; /* FALLTHROUGH */
+	case 'm': case 'M': shift += 10; /* FALLTHROUGH */
+	case 'k': case 'K': shift += 10; end++;
+	}
+	if (*end || n == 0 || n > SIZE_MAX >> shift)
+		errx(1, "invalid size: %s", s);
+	return n << shift;
+}
+
+/* parse a rate limit [uid:|comm:]RATE[/BURST].  */
+static void
+add_limit(const char *s)
+{
+	int kind = EXTRACE_LIMIT_ALL;
+	unsigned long rate, burst = 0;
+	const char *p = s;
+	char *end;
+
+	if (strncmp(p, "uid:", 4) == 0)
+		kind = EXTRACE_LIMIT_UID, p += 4;
+	else if (strncmp(p, "comm:", 5) == 0)
+		kind = EXTRACE_LIMIT_COMM, p += 5;
+	rate = strnum(p, &end, UINT_MAX);
+	if (end != p && *end == '/') {
+		p = end + 1;
+		burst = strnum(p, &end, UINT_MAX);
+	}
+	if (*end || end == p || extrace_limit(tracer, kind, rate, burst) == -1)
+		errx(1, "invalid limit: %s", s);
+}
+
+static void
+print_suppressed(int kind, const char *key, unsigned long n, void *arg)
+{
+	(void)arg;
+	switch (kind) {
+	case EXTRACE_LIMIT_ALL:
+		fprintf(stderr, "extrace: suppressed %lu execs\n", n);
+		break;
+	case EXTRACE_LIMIT_UID:
+		fprintf(stderr, "extrace: suppressed %lu execs of uid %s\n", n, key);
+		break;
+	case EXTRACE_LIMIT_COMM:
+		fprintf(stderr, "extrace: suppressed %lu execs of %s\n", n, key);
+		break;
+	}
+}
+
+/* read lines "PATTERN" or "TAG<TAB>PATTERN" from file.  */
+static void
+read_tags(const char *file)
+{
+	FILE *f;
+	char *line = 0, *tab;
+	size_t linecap = 0;
+	ssize_t n;
+
+	if (!(f = fopen(file, "r")))
+		err(1, "%s", file);
+	while ((n = getline(&line, &linecap, f)) != -1) {
+		if (n > 0 && line[n-1] == '\n')
+			line[--n] = 0;
+		if (!*line)
+			continue;
+		tab = strchr(line, '\t');
+		if (tab)
+			*tab++ = 0;
+		if (extrace_tag(tracer, line, tab ? tab : line) == -1)
+			err(1, "%s: %s", file, tab ? tab : line);
+	}
+	free(line);
+	fclose(f);
+}
+
+static void
+print_tag_stats(void)
+{
+	struct extrace_stats st;
+
+	extrace_stats(tracer, &st);
+	fprintf(stderr, "extrace: tags: %zu patterns, %zu states, "
+	    "%lu of %lu execs tagged, %llu bytes scanned in %.3fs (%.1f MB/s)\n",
+	    st.tag_patterns, st.tag_states, st.tagged, st.events,
+	    (unsigned long long)st.tag_bytes, st.tag_ns / 1e9,
+	    st.tag_ns ? st.tag_bytes * 1e3 / st.tag_ns : 0.0);
+}
+
+static void
+finish(void)
+{
+	if (capture && fclose(capture) == EOF)
+		warn("%s", capfile);
+	if (tracer && trace_flags & EXTRACE_ENVDIFF)
+		print_env_stats();
+	if (tracer && tagfile)
+		print_tag_stats();
+	if (tracer && nlimitv)
+		extrace_suppressed(tracer, print_suppressed, 0);
+	if (tracer && format == FMT_CHROME)
+		chrome_finish();
+	if (tracer && format == FMT_COMPDB)
+		compdb_finish();
+	if (tracer && proctree)
+		prof_end();
+	if (tracer && format == FMT_FOLDED) {
+		fold_flush();
+		fold_free();
+	}
+	if (tracer && profile)
+		print_profile();
+	if (tracer && concf)
+		conc_finish();
+	if (tracer && sample > 1) {
+		struct extrace_stats st;
+
+		extrace_stats(tracer, &st);
+		fprintf(stderr, "extrace: sampled 1 in %u, %lu execs skipped\n",
+		    sample, st.sampled);
+	}
+
+	if (next_output) {
+		char next[PATH_MAX];
+		fclose(next_output);
+		snprintf(next, sizeof next, "%s.next", outfile);
+		unlink(next);
+	}
+	if (rotate_gzip) {
+		fflush(output);
+		gzip_finish();
+	}
+	if (compress_method) {
+		compress_finish();
+		print_compress_stats();
+	} else {
+		fflush(output);
+	}
+	if (sockpath) {
+		while (clients)
+			client_close(clients);
+		unlink(sockpath);
+		if (clients_dropped)
+			fprintf(stderr, "extrace: %lu records dropped for slow "
+			    "subscribers\n", clients_dropped);
+	}
 }
 
 int
 main(int argc, char *argv[])
 {
+	struct extrace_stats st;
 	struct kevent kev[4];
+	struct client *c;
+	const char *input = 0;
+	const char *progname;
+	const char *errstr;
+	char *end;
+	int compress_set = 0;
 	int opt, i, n;
+	uint64_t t;
 
 	output = stdout;
 
-	while ((opt = getopt(argc, argv, "deflo:p:qw")) != -1)
+	progname = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+	if (strcmp(progname, "extrace-decode") == 0)
+		input = "-";
+
+	while ((opt = getopt(argc, argv, "Ab:c:C:deEfF:IK:lL:m:M:n:o:O:p:Pqr:R:s:S:t:T:wW:x:z")) != -1)
 		switch (opt) {
-		case 'd': show_cwd = 1; break;
-		case 'e': show_env = 1; break;
+		case 'A': self_trace = 1; break;
+		case 'b':
+			if (strcmp(optarg, "block") == 0)
+				backpressure_drop = 0;
+			else if (strcmp(optarg, "drop") == 0)
+				backpressure_drop = 1;
+			else
+				goto usage;
+			break;
+		case 'C': concfile = optarg; break;
+		case 'c':
+			if (strcmp(optarg, "none") == 0)
+				compress_method = COMP_NONE;
+			else if (strcmp(optarg, "zstd") == 0)
+				compress_method = COMP_ZSTD;
+			else if (strcmp(optarg, "lz4") == 0)
+				compress_method = COMP_LZ4;
+			else
+				goto usage;
+			compress_set = 1;
+			break;
+		case 'd': trace_flags |= EXTRACE_CWD; break;
+		case 'e': trace_flags |= EXTRACE_ENV; break;
+		case 'E': trace_flags |= EXTRACE_ENV | EXTRACE_ENVDIFF; break;
 		case 'f': flat = 1; break;
-		case 'l': full_path = 1; break;
-		case 'p': parent = atoi(optarg); break;
+		case 'F': filter = optarg; break;
+		case 'I': intern = 1; break;
+		case 'K':
+			if (!(extra_compilers = realloc(extra_compilers,
+			    (nextra_compilers + 1) * sizeof *extra_compilers)))
+				err(1, "realloc");
+			extra_compilers[nextra_compilers++] = optarg;
+			break;
+		case 'l': trace_flags |= EXTRACE_PATH; break;
+		case 'L':
+			if (nlimitv == 8)
+				errx(1, "too many -L");
+			limitv[nlimitv++] = optarg;
+			break;
+		case 'm': ring_size = parse_size(optarg); break;
+		case 'M': shmname = optarg; break;
+		case 'n':
+			if (!(sample = strnum(optarg, &end, UINT_MAX)) || *end)
+				goto usage;
+			break;
+		case 'p': add_pid(&roots, &nroots, optarg); break;
+		case 'P': profile = 1; break;
 		case 'q': show_args = 0; break;
-		case 'o':
-			output = fopen(optarg, "w");
-			if (!output) {
-				  perror("fopen");
-				  exit(1);
-			}
+		case 'r': input = optarg; break;
+		case 'R': replayfile = optarg; break;
+		case 's': rotate_size = parse_size(optarg); break;
+		case 'S': sockpath = optarg; break;
+		case 'T': tagfile = optarg; break;
+		case 't':
+			if (!(rotate_interval = strnum(optarg, &end,
+			    INT_MAX / 1000)) || *end)
+				goto usage;
+			break;
+		case 'z': rotate_gzip = 1; break;
+		case 'o': outfile = optarg; break;
+		case 'O':
+			if (strcmp(optarg, "text") == 0)
+				format = FMT_TEXT;
+			else if (strcmp(optarg, "bin") == 0)
+				format = FMT_BIN;
+			else if (strcmp(optarg, "json") == 0)
+				format = FMT_JSON;
+			else if (strcmp(optarg, "chrome") == 0)
+				format = FMT_CHROME;
+			else if (strcmp(optarg, "folded") == 0)
+				format = FMT_FOLDED;
+			else if (strcmp(optarg, "compdb") == 0)
+				format = FMT_COMPDB;
+			else
+				goto usage;
 			break;
 		case 'w': /* obsoleted, ignore */; break;
+		case 'W': capfile = optarg; break;
+		case 'x': add_pid(&excludes, &nexcludes, optarg); break;
 		default: goto usage;
 		}
 
-	if (parent != 1 && optind != argc) {
+	/* pick the compressor from the file name unless given.  */
+	if (outfile && !compress_set) {
+		size_t l = strlen(outfile);
+		if (l > 4 && strcmp(outfile + l - 4, ".zst") == 0)
+			compress_method = COMP_ZSTD;
+		else if (l > 4 && strcmp(outfile + l - 4, ".lz4") == 0)
+			compress_method = COMP_LZ4;
+	}
+#ifndef HAVE_ZSTD
+	if (compress_method == COMP_ZSTD)
+		errx(1, "built without zstd support");
+#endif
+#ifndef HAVE_LZ4
+	if (compress_method == COMP_LZ4)
+		errx(1, "built without lz4 support");
+#endif
+	if (compress_method && (ring_size || shmname || rotate_size || rotate_interval))
+		errx(1, "-c cannot be used with -m, -M, -s or -t");
+
+	if (format >= FMT_CHROME && (input || intern || ring_size ||
+	    shmname || rotate_size || rotate_interval))
+		errx(1, "-O %s cannot be used with -I, -m, -M, -r, -s or -t",
+		    format == FMT_CHROME ? "chrome" :
+		    format == FMT_FOLDED ? "folded" : "compdb");
+	if (format == FMT_COMPDB) {
+		/* the full command line in its directory.  */
+		trace_flags |= EXTRACE_CWD;
+		show_args = 1;
+	}
+
+	if (shmname) {
+		if (intern)
+			errx(1, "-M cannot be used with -I");
+		format = FMT_BIN;
+		ring_open(shmname, ring_size ? ring_size : SHM_RING_SIZE, 1);
+	} else if (ring_size) {
+		if (!outfile)
+			errx(1, "-m needs -o FILE");
+		if (intern)
+			errx(1, "-m cannot be used with -I");
+		format = FMT_BIN;
+		ring_open(outfile, ring_size, 0);
+	} else if (outfile) {
+		output = fopen(outfile, "w");
+		if (!output) {
+			  perror("fopen");
+			  exit(1);
+		}
+	}
+
+	if (rotate_size || rotate_interval) {
+		if (!outfile || ring)
+			errx(1, "-s and -t need -o FILE without -m or -M");
+		next_output = open_next();
+		if (rotate_gzip &&
+		    (errno = pthread_create(&gzthread, 0, gzip_worker, 0)))
+			err(1, "pthread_create");
+	} else {
+		rotate_gzip = 0;
+	}
+
+	if (compress_method)
+		compress_start();
+
+	json_init();
+	if (format == FMT_BIN && !ring) {
+		if (compress_method)
+			compress_put(BIN_MAGIC, sizeof BIN_MAGIC - 1);
+		else
+			fwrite(BIN_MAGIC, 1, sizeof BIN_MAGIC - 1, output);
+	}
+	if (format == FMT_CHROME || format == FMT_COMPDB)
+		out_write("[", 1);
+
+	if (input) {
+		/* extrace-decode FILE */
+		if (strcmp(progname, "extrace-decode") == 0 && optind < argc)
+			input = argv[optind++];
+		if (optind != argc)
+			goto usage;
+		decode(input);
+		finish();
+		return 0;
+	}
+
+	if ((nroots || replayfile) && optind != argc) {
 usage:
-		fprintf(stderr, "Usage: extrace [-deflq] [-o FILE] [-p PID|CMD...]\n");
+		fprintf(stderr, "Usage: extrace [-AdeEfIlPqz] [-b POL] [-c METH] [-C FILE] [-F EXPR] [-O FORMAT]\n"
+		    "               [-S SOCK] [-T FILE] [-K NAME]... [-L LIM]... [-n N]\n"
+		    "               [-M NAME | -o FILE [-m SIZE] [-s SIZE] [-t SECS]]\n"
+		    "               [-R FILE | -W FILE] [-x PID]... [-p PID... | CMD...]\n"
+		    "       extrace [-fIq] [-O FORMAT] [-o FILE] -r FILE\n");
 		exit(1);
 	}
 
 	if ((kq = kqueue()) == -1)
 		err(1, "kqueue");
 
-	kd = kvm_openfiles(0, 0, 0, O_RDONLY, 0);
-	if (!kd)
-		err(1, "kvm_open");
+	if (replayfile && capfile)
+		goto usage;
+	tracer = extrace_open(trace_flags | (flat ? EXTRACE_FLAT : 0) |
+	    (show_args ? 0 : EXTRACE_ARGV0) |
+	    (replayfile ? EXTRACE_REPLAY : 0), emit, 0);
+	if (!tracer)
+		err(1, "extrace_open");
+	if (capfile && (!(capture = fopen(capfile, "w")) ||
+	    extrace_record(tracer, capture) == -1))
+		err(1, "%s", capfile);
+	if (filter && extrace_filter(tracer, filter, &errstr) == -1)
+		errx(1, "-F: %s", errstr);
+	if (tagfile)
+		read_tags(tagfile);
+	for (i = 0; i < nlimitv; i++)
+		add_limit(limitv[i]);
+	if (sample)
+		extrace_sample(tracer, sample);
+	if (concfile && !(concf = fopen(concfile, "w")))
+		err(1, "%s", concfile);
+	proctree = profile || concf || format == FMT_FOLDED;
+	if (proctree)
+		extrace_forks(tracer, prof_fork, 0);
+	if (format == FMT_CHROME || proctree)
+		extrace_exits(tracer, exited, 0);
+	if (format == FMT_FOLDED) {
+		EV_SET(&kev[0], 3, EVFILT_TIMER, EV_ADD, 0,
+		    FOLD_INTERVAL * 1000, 0);
+		if (kevent(kq, kev, 1, 0, 0, 0) == -1)
+			err(1, "kevent");
+	}
 
 	if (optind != argc) {
 		EV_SET(&kev[0], SIGCHLD, EVFILT_SIGNAL, EV_ADD, 0, 0, 0);
 		if (kevent(kq, kev, 1, 0, 0, 0) == -1)
 			err(1, "kevent");
 
-		switch ((parent = fork())) {
+		if (!(roots = realloc(roots, (nroots + 1) * sizeof *roots)))
+			err(1, "realloc");
+		switch ((roots[nroots++] = fork())) {
 		case -1: err(1, "fork"); break;
 		case 0:
 			execvp(argv[optind], argv+optind);
 			err(1, "execvp");
 		}
-	} 
+	}
+
+	if (sockpath) {
+		if (intern)
+			errx(1, "-S cannot be used with -I");
+		serve_open();
+	}
 
 	signal(SIGINT, SIG_IGN);
 	EV_SET(&kev[0], SIGINT, EVFILT_SIGNAL, EV_ADD, 0, 0, 0);
+	if (kevent(kq, kev, 1, 0, 0, 0) == -1)
+		err(1, "kevent");
+	signal(SIGSTATS, SIG_IGN);
+	EV_SET(&kev[0], SIGSTATS, EVFILT_SIGNAL, EV_ADD, 0, 0, 0);
 	if (kevent(kq, kev, 1, 0, 0, 0) == -1)
 		err(1, "kevent");
 
-	if (parent != 1) {
-		EV_SET(&kev[0], parent, EVFILT_PROC, EV_ADD, NOTE_EXEC | NOTE_TRACK, 0, 0);
+	if (rotate_interval) {
+		EV_SET(&kev[0], 1, EVFILT_TIMER, EV_ADD, 0, rotate_interval * 1000, 0);
 		if (kevent(kq, kev, 1, 0, 0, 0) == -1)
 			err(1, "kevent");
-	} else {
-		struct kinfo_proc *kp;
-		struct kevent *kevs;
+	}
+	if (nlimitv) {
+		EV_SET(&kev[0], 2, EVFILT_TIMER, EV_ADD, 0,
+		    SUPPRESS_INTERVAL * 1000, 0);
+		if (kevent(kq, kev, 1, 0, 0, 0) == -1)
+			err(1, "kevent");
+	}
 
-again:
-		kp = kvm_getprocs(kd, KERN_PROC_ALL, 0, &n);
-		if (!kp) {
-			fprintf(stderr, "extrace: kvm_getprocs ALL: %s\n", kvm_geterr(kd));
-			return -1;
-		}
-		if (!(kevs = calloc(n, sizeof (struct kevent))))
-			err(1, "calloc");
-		for (i = 0; i < n; i++) {
-			if (!kp[i].ki_pid || !kp[i].ki_ppid)
-				continue;
-			if (kp[i].ki_stat == SZOMB)
-				continue;
-			EV_SET(&kevs[i], kp[i].ki_pid, EVFILT_PROC, EV_ADD, NOTE_EXEC | NOTE_TRACK, 0, 0);
+	/*
+	 * The rest of our pipeline would trace its own reaction to us.  A
+	 * shell with job control runs it in a process group of its own;
+	 * otherwise the group is shared with the shell, and only the
+	 * processes having our pipe open are left out.
+	 */
+	if (!self_trace && !replayfile && optind == argc &&
+	    (is_pipe(0) || is_pipe(1))) {
+		pid_t pg = getpgrp();
+
+		if (pg == getpid() ||
+		    (pg != getsid(0) && pg != getpgid(getppid()))) {
+			if (extrace_exclude_pgrp(tracer, pg) == -1)
+				err(1, "extrace_exclude_pgrp");
+		} else {
+			for (i = 0; i < 2; i++)
+				if (is_pipe(i) &&
+				    extrace_exclude_pipe(tracer, i) == -1)
+					warn("extrace_exclude_pipe");
 		}
-		errno = 0;
-		if (kevent(kq, kevs, n, 0, 0, 0) == -1)
-			warn("kevent ALL");
-		free(kevs);
-		if (errno == ESRCH)
-			goto again;
 	}
+	for (i = 0; i < (int)nexcludes; i++)
+		if (extrace_exclude(tracer, excludes[i]) == -1)
+			err(1, "-x %d", excludes[i]);
+	if (!nroots)
+		add_pid(&roots, &nroots, "1");
+	for (i = 0; i < (int)nroots; i++)
+		if (extrace_trace(tracer, roots[i]) == -1)
+			err(1, "-p %d", roots[i]);
+	extrace_stats(tracer, &st);
+	if (st.unattached)
+		warnx("cannot trace %lu processes", st.unattached);
+
+	if (replayfile) {
+		FILE *f = strcmp(replayfile, "-") == 0 ? stdin :
+		    fopen(replayfile, "r");
+
+		t_start = mono_ns();
+		if (!f || extrace_replay(tracer, f) == -1)
+			err(1, "%s", replayfile);
+		fclose(f);
+		print_timing();
+		finish();
+		return 0;
+	}
+	EV_SET(&kev[0], extrace_fd(tracer), EVFILT_READ, EV_ADD, 0, 0, 0);
+	if (kevent(kq, kev, 1, 0, 0, 0) == -1)
+		err(1, "kevent");
 
+	t_start = mono_ns();
 	while (!quit) {
 		n = kevent(kq, 0, 0, kev, 4, 0);
 		for (i = 0; i < n; i++)  {
 			struct kevent *ke = &kev[i];
 			switch (ke->filter) {
 			case EVFILT_SIGNAL:
-				if (ke->ident == SIGCHLD)
+				if (ke->ident == SIGSTATS) {
+					print_timing();
+					break;
+				}
+				if (ke->ident == SIGCHLD) {
 					while (waitpid(-1, 0, WNOHANG) > 0)
 						;
+					drain();
+				}
 				quit = 1;
 				break;
-			case EVFILT_PROC:
-				if (ke->fflags & NOTE_EXEC)
-					handle_msg(ke->ident);
+			case EVFILT_TIMER:
+				if (ke->ident == 2)
+					extrace_suppressed(tracer,
+					    print_suppressed, 0);
+				else if (ke->ident == 3)
+					fold_flush();
+				else if (outbytes > 0)
+					rotate();
+				break;
+			case EVFILT_READ:
+				if ((int)ke->ident == extrace_fd(tracer)) {
+					if (extrace_dispatch(tracer, 0) == -1)
+						err(1, "extrace_dispatch");
+				} else if ((int)ke->ident == lfd) {
+					client_accept();
+				} else if ((c = client_find(ke->ident))) {
+					client_read(c);
+				}
+				break;
+			case EVFILT_WRITE:
+				if ((c = client_find(ke->ident)))
+					client_flush(c);
+				break;
 			}
 			if (quit)
 				break;
 		}
+		/* flush once per batch of events, not per record.  */
+		t = mono_ns();
+		if (!compress_method)
+			fflush(output);
+		if (sockpath)
+			clients_flush();
+		extrace_hist_add(&t_flush, mono_ns() - t);
 	}
 
+	finish();
 	return 0;
 }
@@ -0,0 +1,165 @@
+/* extrace.h - trace exec() calls from within a program
+ *
+ * libextrace does the capturing part of extrace(1): it follows the
+ * process tree with kqueue and fetches argv, cwd, path and environment
+ * of every new program, and hands each one to a callback:
+ *
+ *	static void
+ *	show(struct exec_event *ev, void *arg)
+ *	{
+ *		printf("%d %s\n", ev->pid, ev->argv[0]);
+ *	}
+ *
+ *	struct extrace *x = extrace_open(EXTRACE_CWD, show, 0);
+ *	if (!x || extrace_trace(x, 1) == -1)
+ *		err(1, "extrace");
+ *	while (extrace_dispatch(x, -1) != -1)
+ *		;
+ *
+ * extrace_dispatch() handles one batch of kernel events and returns the
+ * number of exec_events delivered.  extrace_fd() can be watched with
+ * poll(2) or kqueue(2) to run the tracer from an existing event loop.
+ * extrace_filter() restricts the events to those matching an expression
+ * as for extrace -F; it is checked before any costly fields are read.
+ * extrace_filter_new() compiles an expression to be checked by the
+ * callback itself with extrace_match(), e.g. once per consumer.
+ * extrace_tag() adds a pattern: events with an argv or env string
+ * containing it carry its tag.  All patterns are matched at once.
+ * extrace_limit() and extrace_sample() thin out exec storms before any
+ * costly fields are read; extrace_suppressed() reports what was dropped.
+ * extrace_timing() gives a histogram of the time spent in each stage.
+ * extrace_forks() and extrace_exits() report when traced processes are
+ * created and when they exit.
+ * extrace_record() saves the kernel events with all answers read for
+ * them; extrace_replay() feeds such a capture through the same code.
+ * The event and all strings it points to are only valid during the
+ * callback.  Tracing needs the privileges of extrace(1).  The library
+ * prints nothing: on failure, functions return -1 or NULL with errno
+ * set.  When extrace_dispatch() runs out of memory, the events of the
+ * batch were still handled as far as possible.
+ *
+ * Copyright (c) 2014-2016, 2023 Leah Neukirchen <leah@vuxu.org>
+ * Copyright (c) 2017 Duncan Overbruck <mail@duncano.de>
+ */
+#ifndef EXTRACE_H
+#define EXTRACE_H
+
+#include <sys/types.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* fields to fetch, and the fields present in an exec_event.  */
+#define EXTRACE_CWD     0x01
+#define EXTRACE_PATH    0x02	/* full path of the executable */
+#define EXTRACE_ENV     0x04
+#define EXTRACE_ENVDIFF 0x10	/* envp only has changes, unset is set */
+#define EXTRACE_TAGS    0x20	/* tags is set, see extrace_tag() */
+
+/* options only.  */
+#define EXTRACE_ARGV0   0x100	/* fetch argv[0] only */
+#define EXTRACE_FLAT    0x200	/* do not compute depth */
+#define EXTRACE_REPLAY  0x400	/* events come from extrace_replay() */
+
+/* kinds of extrace_limit().  */
+#define EXTRACE_LIMIT_ALL  0
+#define EXTRACE_LIMIT_UID  1	/* a bucket for each real uid */
+#define EXTRACE_LIMIT_COMM 2	/* a bucket for each command name */
+
+struct exec_event {
+	uint64_t time;		/* ns since the epoch */
+	pid_t pid;
+	pid_t ppid;
+	int depth;		/* below the traced process, -1 if not computed */
+	int flags;		/* EXTRACE_* fields present */
+	char *cwd;		/* NULL if unknown */
+	char *path;		/* NULL if unknown */
+	int argc;
+	char **argv;		/* NULL-terminated */
+	int envc;
+	char **envp;		/* NULL if unreadable */
+	int unsetc;
+	char **unset;		/* with EXTRACE_ENVDIFF, removed variables */
+	int tagc;
+	char **tags;		/* with EXTRACE_TAGS, tags of matched patterns */
+};
+
+/* log-linear histogram, EXTRACE_HIST_SUB buckets per power of two.  */
+#define EXTRACE_HIST_SUB 4
+
+struct extrace_hist {
+	uint64_t n;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t b[64 * EXTRACE_HIST_SUB];
+};
+
+/* stages timed for extrace_timing(), in ns.  */
+#define EXTRACE_T_KINFO    0	/* kvm_getprocs() */
+#define EXTRACE_T_TREE     1	/* classification in the process table */
+#define EXTRACE_T_PATH     2	/* KERN_PROC_PATHNAME */
+#define EXTRACE_T_ARGV     3	/* kvm_getargv(), tag scan */
+#define EXTRACE_T_CWD      4	/* KERN_PROC_CWD */
+#define EXTRACE_T_ENV      5	/* kvm_getenvv(), tag scan, diff */
+#define EXTRACE_T_CB       6	/* the callback */
+#define EXTRACE_T_EVENT    7	/* all of it, for delivered events */
+#define EXTRACE_T_MAX      8
+
+struct extrace_stats {
+	unsigned long events;
+	size_t procs;		/* processes with a kept environment */
+	size_t envsets;		/* distinct environments kept */
+	size_t envbytes;
+	size_t envbytes_max;
+	size_t envbytes_limit;
+	unsigned long envsets_dropped;	/* not kept, over the limit */
+	unsigned long filtered;		/* events dropped by the filter */
+	size_t tag_patterns;
+	size_t tag_states;		/* of the automaton */
+	uint64_t tag_bytes;		/* scanned for patterns */
+	uint64_t tag_ns;		/* time spent scanning */
+	unsigned long tagged;		/* events with at least one tag */
+	unsigned long suppressed;	/* events dropped by the limits */
+	unsigned long sampled;		/* events dropped by sampling */
+	unsigned long races;		/* processes gone before being read */
+	unsigned long unattached;	/* processes that could not be traced */
+};
+
+struct extrace;
+struct extrace_filter;
+
+typedef void extrace_cb(struct exec_event *, void *);
+typedef void extrace_suppressed_cb(int, const char *, unsigned long, void *);
+typedef void extrace_fork_cb(pid_t, pid_t, uint64_t, void *);
+typedef void extrace_exit_cb(pid_t, int, uint64_t, void *);
+
+struct extrace *extrace_open(int, extrace_cb *, void *);
+int extrace_trace(struct extrace *, pid_t);
+int extrace_exclude(struct extrace *, pid_t);
+int extrace_exclude_pgrp(struct extrace *, pid_t);
+int extrace_exclude_pipe(struct extrace *, int);
+int extrace_filter(struct extrace *, const char *, const char **);
+struct extrace_filter *extrace_filter_new(struct extrace *, const char *,
+    const char **);
+int extrace_match(struct extrace *, struct extrace_filter *);
+void extrace_filter_free(struct extrace *, struct extrace_filter *);
+int extrace_tag(struct extrace *, const char *, const char *);
+int extrace_limit(struct extrace *, int, unsigned, unsigned);
+void extrace_sample(struct extrace *, unsigned);
+void extrace_suppressed(struct extrace *, extrace_suppressed_cb *, void *);
+void extrace_forks(struct extrace *, extrace_fork_cb *, void *);
+void extrace_exits(struct extrace *, extrace_exit_cb *, void *);
+int extrace_fd(struct extrace *);
+int extrace_dispatch(struct extrace *, int);
+int extrace_record(struct extrace *, FILE *);
+int extrace_replay(struct extrace *, FILE *);
+int extrace_depth(struct extrace *, pid_t, pid_t, pid_t);
+int extrace_ancestors(struct extrace *, pid_t, pid_t *, int);
+void extrace_stats(struct extrace *, struct extrace_stats *);
+void extrace_timing(struct extrace *, int, struct extrace_hist *);
+void extrace_hist_add(struct extrace_hist *, uint64_t);
+uint64_t extrace_hist_pct(const struct extrace_hist *, double);
+void extrace_close(struct extrace *);
+
+#endif
@@ -0,0 +1,158 @@
+/* extrace_ring.h - ring of extrace binary records, and a lock-free reader
+ *
+ * extrace -m writes this to a file, extrace -M to a POSIX shared memory
+ * object: the header, then size bytes of binary records written
+ * circularly.  head and tail count bytes ever written; the records from
+ * tail to head are intact.  The writer advances tail before overwriting
+ * old records and head after writing a new one, so a reader that sees
+ * tail move past a record while copying it knows the copy is torn.
+ * gen is odd while an update is in progress.
+ *
+ * Any number of readers can follow a ring without taking locks:
+ *
+ *	struct ring_reader rd;
+ *	char buf[65536];
+ *	long n;
+ *
+ *	if (ring_attach(&rd, "/extrace", 0) == -1)
+ *		err(1, "ring_attach");
+ *	for (;;)
+ *		while ((n = ring_read(&rd, buf, sizeof buf)) != 0)
+ *			if (n > 0)
+ *				... buf holds one length-prefixed record ...
+ *
+ * ring_read() returns 0 when there is nothing new; poll again later.
+ * Records that were overwritten before they could be read are counted
+ * in rd.lost.
+ *
+ * Copyright (c) 2014-2016, 2023 Leah Neukirchen <leah@vuxu.org>
+ * Copyright (c) 2017 Duncan Overbruck <mail@duncano.de>
+ */
+#ifndef EXTRACE_RING_H
+#define EXTRACE_RING_H
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RING_MAGIC "EXTRING\001"
+
+struct ring {
+	char magic[8];
+	uint64_t size;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t gen;
+	char data[];
+};
+
+struct ring_reader {
+	const struct ring *ring;
+	uint64_t pos;
+	uint64_t lost;		/* bytes overwritten before they were read */
+	uint64_t skipped;	/* records too large for the caller's buffer */
+};
+
+/* start reading r at the oldest record if from_tail, else at new ones.  */
+static inline void
+ring_reader_init(struct ring_reader *rd, const struct ring *r, int from_tail)
+{
+	rd->ring = r;
+	rd->pos = __atomic_load_n(from_tail ? &r->tail : &r->head,
+	    __ATOMIC_ACQUIRE);
+	rd->lost = rd->skipped = 0;
+}
+
+/* map the shared memory ring name read-only, returns -1 on error.  */
+static inline int
+ring_attach(struct ring_reader *rd, const char *name, int from_tail)
+{
+	struct stat st;
+	void *m;
+	int fd;
+
+	if ((fd = shm_open(name, O_RDONLY, 0)) == -1)
+		return -1;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof (struct ring)) {
+		close(fd);
+		return -1;
+	}
+	m = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED)
+		return -1;
+	if (memcmp(m, RING_MAGIC, 8) != 0 ||
+	    ((struct ring *)m)->size + sizeof (struct ring) > (size_t)st.st_size) {
+		munmap(m, st.st_size);
+		return -1;
+	}
+	ring_reader_init(rd, m, from_tail);
+	return 0;
+}
+
+/*
+ * Copy the next record, including its length prefix, into buf.
+ * Returns its length, 0 if there is no new record, or -1 if it did not
+ * fit into size bytes and was skipped.
+ */
+static inline long
+ring_read(struct ring_reader *rd, char *buf, size_t size)
+{
+	const struct ring *r = rd->ring;
+	uint64_t head, tail, len, n;
+	size_t o, m;
+	int c, i;
+
+	for (;;) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (rd->pos == head)
+			return 0;
+		tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if (rd->pos < tail || head - rd->pos > r->size) {
+			rd->lost += tail - rd->pos;
+			rd->pos = tail;
+			continue;
+		}
+
+		len = 0;
+		i = 0;
+		do {
+			c = (unsigned char)r->data[(rd->pos + i) % r->size];
+			len |= (uint64_t)(c & 0x7f) << (7*i);
+			i++;
+		} while (c & 0x80 && i < 10);
+		n = len + i;
+
+		if (n <= head - rd->pos && n <= size) {
+			o = rd->pos % r->size;
+			m = n < r->size - o ? n : r->size - o;
+			memcpy(buf, r->data + o, m);
+			memcpy(buf + m, r->data, n - m);
+		}
+
+		/* the writer moves tail before it overwrites anything.  */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > rd->pos)
+			continue;
+
+		if (n > head - rd->pos) {
+			/* cannot happen unless the writer is broken.  */
+			rd->lost += head - rd->pos;
+			rd->pos = head;
+			return 0;
+		}
+		rd->pos += n;
+		if (n > size) {
+			rd->skipped++;
+			return -1;
+		}
+		return n;
+	}
+}
+
+#endif
@@ -0,0 +1,2426 @@
+/* libextrace - capture exec() calls with kqueue, see extrace.h
+ *
+ * Copyright (c) 2014-2016, 2023 Leah Neukirchen <leah@vuxu.org>
+ * Copyright (c) 2017 Duncan Overbruck <mail@duncano.de>
+ */
+
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/param.h>
+#include <sys/proc.h>
+#include <sys/sysctl.h>
+#include <sys/user.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <kvm.h>
+#include <regex.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "extrace.h"
+
+struct buf {
+	char *s;
+	size_t len;
+	size_t cap;
+	int failed;		/* a buf_grow() failed since the last reset */
+};
+
+/* environment variable of an envset, kept sorted by key hash.  */
+struct envvar {
+	uint32_t khash;		/* hash of the name */
+	uint32_t ehash;		/* hash of name=value */
+	char *key;
+	size_t klen;
+};
+
+/* environment as last seen, shared by all processes with the same one.  */
+struct envset {
+	uint32_t hash;
+	int refs;
+	size_t n;
+	size_t size;
+	struct envset *next;
+	struct envvar vars[];
+};
+
+/* traced process.  */
+struct proc {
+	pid_t pid;
+	pid_t ppid;
+	int depth;		/* below the nearest root, -1 if unknown */
+	int excluded;		/* in an excluded subtree */
+	struct envset *env;
+	struct proc *next;
+};
+
+#define PROC_BUCKETS 4096
+#define ENV_BUCKETS  1024
+#define ENV_BYTES    (16 << 20)
+
+#define BATCH 64	/* kernel events read at once */
+
+/*
+ * Token bucket of a rate limit, one per uid or comm for keyed limits.
+ * Tokens are counted in billionths, refilled by rate per ns.
+ */
+struct bucket {
+	uint32_t hash;
+	uid_t uid;
+	char comm[COMMLEN + 1];
+	uint64_t tokens;
+	uint64_t last;
+	unsigned long suppressed;	/* since the last extrace_suppressed() */
+	struct bucket *next;
+};
+
+#define LIMIT_BUCKETS 256
+#define MAXLIMITS 8
+
+struct limit {
+	int kind;		/* EXTRACE_LIMIT_* */
+	uint64_t rate;		/* per second */
+	uint64_t burst;
+	struct bucket *tab[LIMIT_BUCKETS];
+};
+
+/*
+ * Filter bytecode, in postfix order.  It is evaluated in stages as the
+ * fields become known, with unknown fields giving an unknown result, so
+ * an event is dropped as soon as the cheap fields decide it.
+ */
+enum { F_PRED, F_AND, F_OR, F_NOT };
+enum { S_KINFO, S_TREE, S_EXE, S_ARGV };
+enum { C_EQ, C_NE, C_LT, C_LE, C_GT, C_GE, C_MATCH, C_NOMATCH };
+enum { K_UID, K_GID, K_JAIL, K_PID, K_PPID, K_COMM, K_DEPTH, K_UNDER,
+    K_EXE, K_ARGV };
+
+static const struct {
+	const char *name;
+	int stage;
+	int isstr;
+} fkeys[] = {
+	[K_UID] = { "uid", S_KINFO, 0 },
+	[K_GID] = { "gid", S_KINFO, 0 },
+	[K_JAIL] = { "jail", S_KINFO, 0 },
+	[K_PID] = { "pid", S_KINFO, 0 },
+	[K_PPID] = { "ppid", S_KINFO, 0 },
+	[K_COMM] = { "comm", S_KINFO, 1 },
+	[K_DEPTH] = { "depth", S_TREE, 0 },
+	[K_UNDER] = { "under", S_TREE, 0 },
+	[K_EXE] = { "exe", S_EXE, 1 },
+	[K_ARGV] = { "argv", S_ARGV, 1 },
+};
+
+static const char *fcmps[] = {
+	[C_EQ] = "=", [C_NE] = "!=", [C_LT] = "<", [C_LE] = "<=",
+	[C_GT] = ">", [C_GE] = ">=", [C_MATCH] = "~", [C_NOMATCH] = "!~",
+};
+
+struct fins {
+	int op;
+	int key;
+	int cmp;
+	long num;
+	char *str;
+	regex_t re;
+};
+
+/* a compiled filter expression.  */
+struct extrace_filter {
+	struct fins *code;
+	size_t n, cap;
+	char *stack;
+	int stages;			/* bit set of stages used */
+	struct extrace_filter *next;	/* on the list of match filters */
+};
+
+/* fields of the event being filtered, known up to stage.  */
+struct fvals {
+	int stage;
+	int done;		/* the filter has decided */
+	const struct kinfo_proc *kp;
+	int depth;
+	const char *exe;
+	const char *args;
+};
+
+struct fparse {
+	struct extrace *x;
+	struct extrace_filter *f;
+	const char *s;
+	const char *p;
+	const char *err;
+};
+
+/*
+ * Aho-Corasick automaton of the tag patterns: a trie whose edges live in
+ * one open-addressed hash keyed by state and byte, with failure links
+ * and dictionary links to the next state on the failure chain that ends
+ * a pattern.  Each argv and env string is scanned once.
+ */
+#define AC_MAXSTATES (1 << 24)
+
+struct acstate {
+	uint32_t parent;
+	uint32_t fail;
+	uint32_t dict;		/* nearest fail state ending a pattern, or 0 */
+	uint32_t pat;		/* pattern id+1 ending here, or 0 */
+	uint32_t depth;
+	unsigned char c;	/* byte of the edge from parent */
+};
+
+struct acedge {
+	uint32_t key;		/* (state << 8 | byte) + 1, 0 if empty */
+	uint32_t to;
+};
+
+struct extrace {
+	int flags;
+	extrace_cb *cb;
+	void *arg;
+	extrace_fork_cb *forkcb;
+	void *forkarg;
+	extrace_exit_cb *exitcb;
+	void *exitarg;
+	int tree;			/* classify by the process table */
+	pid_t *excl;
+	size_t nexcl;
+	pid_t *xpgrp;			/* excluded process groups */
+	size_t nxpgrp;
+	kvm_t *kd;
+	int kq;
+	int fflags;
+	unsigned long events;
+
+	struct buf abuf;		/* saved argv */
+	struct buf ubuf;		/* removed variable names */
+	struct envvar *cur;		/* current environment, sorted */
+	size_t curcap;
+	char **set, **unset;
+	size_t setcap, unsetcap;
+
+	struct proc *ptab[PROC_BUCKETS];
+	size_t nenvprocs;		/* processes with an env */
+	struct envset *etab[ENV_BUCKETS];
+	size_t nenvsets, envbytes, envbytes_max;
+	unsigned long envsets_dropped;
+
+	struct extrace_filter filter;
+	struct extrace_filter *matchers;
+	int mstages;			/* stages used by the matchers */
+	const struct fvals *curfv;	/* during the callback */
+	unsigned long filtered;
+	struct buf jbuf;		/* joined argv for the filter */
+	char ferr[128];
+
+	struct acstate *acs;
+	size_t nacs, acscap;
+	struct acedge *acedges;
+	size_t nacedges, acmask;
+	uint32_t acroot[256];
+	int acbuilt;
+	char **pattag;			/* tag of each pattern */
+	uint32_t *tagid;		/* pattern id to the first with its tag */
+	unsigned long *tagseen;		/* stamp of the last event tagged */
+	size_t npats, patcap;
+	unsigned long tagstamp;
+	char **tagv;
+	size_t ntagv;
+	uint64_t tag_bytes, tag_ns;
+	unsigned long tagged;
+
+	struct limit *limits;
+	size_t nlimits;
+	unsigned long suppressed;
+	unsigned sample;		/* keep 1 in sample events */
+	unsigned long samplen, sampled;
+
+	unsigned long races;
+	unsigned long unattached;
+	struct extrace_hist times[EXTRACE_T_MAX];
+
+	FILE *cap;			/* capture being written */
+	struct buf cbuf;		/* answers read for the current event */
+	uint64_t evtime;		/* of the exec being handled */
+	struct rproc **rtab;		/* answers of the capture being replayed */
+	int error;			/* errno for extrace_dispatch() */
+};
+
+/* -1 if out of memory, b is kept as it was.  */
+static int
+buf_grow(struct buf *b, size_t n)
+{
+	size_t cap = b->cap;
+	char *s;
+
+	if (b->len + n <= cap)
+		return 0;
+	while (b->len + n > cap)
+		cap = cap ? 2*cap : 4096;
+	if (!(s = realloc(b->s, cap))) {
+		b->failed = 1;
+		return -1;
+	}
+	b->s = s;
+	b->cap = cap;
+	return 0;
+}
+
+static int
+buf_put(struct buf *b, const void *p, size_t n)
+{
+	if (buf_grow(b, n) == -1)
+		return -1;
+	memcpy(b->s + b->len, p, n);
+	b->len += n;
+	return 0;
+}
+
+/* copy the NULL-terminated vector v into b, which is reset.  */
+static char **
+save_strv(struct buf *b, char **v)
+{
+	char **r, *p;
+	size_t n, sz = 0, i;
+
+	for (n = 0; v[n]; n++)
+		sz += strlen(v[n]) + 1;
+	b->len = 0;
+	if (buf_grow(b, (n+1) * sizeof (char *) + sz) == -1)
+		return 0;
+	r = (char **)b->s;
+	p = b->s + (n+1) * sizeof (char *);
+	for (i = 0; i < n; i++) {
+		r[i] = p;
+		p = stpcpy(p, v[i]) + 1;
+	}
+	r[n] = 0;
+	b->len = p - b->s;
+	return r;
+}
+
+static int
+strv_len(char **v)
+{
+	int n = 0;
+
+	if (v)
+		while (v[n])
+			n++;
+	return n;
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+extrace_hist_add(struct extrace_hist *h, uint64_t v)
+{
+	int k;
+
+	h->n++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+	if (v < EXTRACE_HIST_SUB) {
+		h->b[v]++;
+		return;
+	}
+	k = 63 - __builtin_clzll(v);	/* k >= 2 */
+	h->b[EXTRACE_HIST_SUB * (k - 1) +
+	    ((v >> (k - 2)) & (EXTRACE_HIST_SUB - 1))]++;
+}
+
+/* lower bound of the bucket holding the p-th fraction of values.  */
+uint64_t
+extrace_hist_pct(const struct extrace_hist *h, double p)
+{
+	uint64_t want = p * h->n, seen = 0;
+	size_t i;
+
+	for (i = 0; i < sizeof h->b / sizeof h->b[0]; i++)
+		if ((seen += h->b[i]) > want) {
+			if (i < EXTRACE_HIST_SUB)
+				return i;
+			return (uint64_t)(EXTRACE_HIST_SUB +
+			    i % EXTRACE_HIST_SUB) << (i / EXTRACE_HIST_SUB - 1);
+		}
+	return h->max;
+}
+
+/* account the time since *t to stage, and start the next one.  */
+static void
+lap(struct extrace *x, int stage, uint64_t *t)
+{
+	uint64_t now = mono_ns();
+
+	extrace_hist_add(&x->times[stage], now - *t);
+	*t = now;
+}
+
+static uint32_t
+hash_bytes(const char *s, size_t len)
+{
+	uint32_t h = 2166136261u;
+
+	while (len--)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+/*
+ * Captures, see extrace_record(): the magic, then records of a type
+ * byte, LEB128 numbers and NUL-terminated strings.  The answers read
+ * for an event come before it, so a replay can serve them by pid:
+ *	'K' pid ppid pgid uid ruid gid jid comm		kinfo
+ *	'A' pid argc arg...				argv
+ *	'V' pid envc var...				environment
+ *	'P' pid path					executable
+ *	'C' pid cwd
+ *	'E' pid fflags data time			kevent, when it was read
+ * A lower case type with only the pid records a failed lookup.
+ */
+#define CAP_MAGIC "EXTRACAP"
+
+enum { R_KINFO = 1, R_ARGV = 2, R_ENV = 4, R_PATH = 8, R_CWD = 16 };
+
+/* answers for a replayed process, the strings point into the capture.  */
+struct rproc {
+	pid_t pid;
+	int have;		/* R_* present */
+	struct kinfo_proc ki;
+	struct buf argv;
+	struct buf envp;
+	char *path;
+	char *cwd;
+	struct rproc *next;
+};
+
+/* cursor over a capture being replayed.  */
+struct rcur {
+	char *p;
+	char *end;
+	int bad;
+};
+
+static void
+cap_var(struct buf *b, uint64_t v)
+{
+	unsigned char c;
+
+	do {
+		c = v & 0x7f;
+		if ((v >>= 7))
+			c |= 0x80;
+		buf_put(b, &c, 1);
+	} while (v);
+}
+
+static void
+cap_str(struct buf *b, const char *s)
+{
+	buf_put(b, s, strlen(s) + 1);
+}
+
+static void
+cap_head(struct buf *b, int type, pid_t pid, int found)
+{
+	char c = found ? type : tolower(type);
+
+	buf_put(b, &c, 1);
+	cap_var(b, pid);
+}
+
+static uint64_t
+rd_var(struct rcur *c)
+{
+	uint64_t v = 0;
+	int shift = 0;
+
+	do {
+		if (c->p >= c->end || shift > 63) {
+			c->bad = 1;
+			return 0;
+		}
+		v |= (uint64_t)(*c->p & 0x7f) << shift;
+		shift += 7;
+	} while (*c->p++ & 0x80);
+	return v;
+}
+
+static char *
+rd_str(struct rcur *c)
+{
+	char *s = c->p, *e;
+
+	if (!(e = memchr(c->p, 0, c->end - c->p))) {
+		c->bad = 1;
+		return (char *)"";
+	}
+	c->p = e + 1;
+	return s;
+}
+
+static struct rproc *
+rproc_get(struct extrace *x, pid_t pid, int create)
+{
+	struct rproc *r;
+
+	if (!x->rtab)
+		return 0;
+	for (r = x->rtab[pid % PROC_BUCKETS]; r; r = r->next)
+		if (r->pid == pid)
+			return r;
+	if (!create)
+		return 0;
+
+	if (!(r = calloc(1, sizeof *r))) {
+		x->error = errno;
+		return 0;
+	}
+	r->pid = pid;
+	r->next = x->rtab[pid % PROC_BUCKETS];
+	x->rtab[pid % PROC_BUCKETS] = r;
+	return r;
+}
+
+/* the kinfo of pid, from the kernel or the capture being replayed.  */
+static struct kinfo_proc *
+src_kinfo(struct extrace *x, pid_t pid)
+{
+	struct kinfo_proc *kp;
+	struct rproc *r;
+	int n;
+
+	if (x->flags & EXTRACE_REPLAY)
+		return (r = rproc_get(x, pid, 0)) && r->have & R_KINFO ?
+		    &r->ki : 0;
+
+	kp = kvm_getprocs(x->kd, KERN_PROC_PID, pid, &n);
+	if (x->cap) {
+		cap_head(&x->cbuf, 'K', pid, kp != 0);
+		if (kp) {
+			cap_var(&x->cbuf, kp->ki_ppid);
+			cap_var(&x->cbuf, kp->ki_pgid);
+			cap_var(&x->cbuf, kp->ki_uid);
+			cap_var(&x->cbuf, kp->ki_ruid);
+			cap_var(&x->cbuf, kp->ki_groups[0]);
+			cap_var(&x->cbuf, kp->ki_jid);
+			cap_str(&x->cbuf, kp->ki_comm);
+		}
+	}
+	return kp;
+}
+
+/* argv or, if env, the environment of the process ki.  */
+static char **
+src_strv(struct extrace *x, struct kinfo_proc *ki, int env)
+{
+	struct rproc *r;
+	char **v;
+	int i;
+
+	if (x->flags & EXTRACE_REPLAY) {
+		if (!(r = rproc_get(x, ki->ki_pid, 0)) ||
+		    !(r->have & (env ? R_ENV : R_ARGV)))
+			return 0;
+		return (char **)(env ? r->envp.s : r->argv.s);
+	}
+
+	v = env ? kvm_getenvv(x->kd, ki, 0) : kvm_getargv(x->kd, ki, 0);
+	if (x->cap) {
+		cap_head(&x->cbuf, env ? 'V' : 'A', ki->ki_pid, v != 0);
+		if (v) {
+			cap_var(&x->cbuf, strv_len(v));
+			for (i = 0; v[i]; i++)
+				cap_str(&x->cbuf, v[i]);
+		}
+	}
+	return v;
+}
+
+/* the path of the executable of pid, stored in buf of size len.  */
+static char *
+src_path(struct extrace *x, pid_t pid, char *buf, size_t len)
+{
+	int name[] = { CTL_KERN, KERN_PROC, KERN_PROC_PATHNAME, pid };
+	struct rproc *r;
+	char *s;
+
+	if (x->flags & EXTRACE_REPLAY)
+		return (r = rproc_get(x, pid, 0)) && r->have & R_PATH ?
+		    r->path : 0;
+
+	s = sysctl(name, 4, buf, &len, 0, 0) == 0 ? buf : 0;
+	if (x->cap) {
+		cap_head(&x->cbuf, 'P', pid, s != 0);
+		if (s)
+			cap_str(&x->cbuf, s);
+	}
+	return s;
+}
+
+/* the cwd of pid, stored in info.  */
+static char *
+src_cwd(struct extrace *x, pid_t pid, struct kinfo_file *info)
+{
+	int name[] = { CTL_KERN, KERN_PROC, KERN_PROC_CWD, pid };
+	size_t len = sizeof *info;
+	struct rproc *r;
+	char *s;
+
+	if (x->flags & EXTRACE_REPLAY)
+		return (r = rproc_get(x, pid, 0)) && r->have & R_CWD ?
+		    r->cwd : 0;
+
+	s = sysctl(name, 4, info, &len, 0, 0) == 0 ? info->kf_path : 0;
+	if (x->cap) {
+		cap_head(&x->cbuf, 'C', pid, s != 0);
+		if (s)
+			cap_str(&x->cbuf, s);
+	}
+	return s;
+}
+
+/* write the answers read for the event ke, then the event.  */
+static void
+cap_event(struct extrace *x, const struct kevent *ke)
+{
+	buf_put(&x->cbuf, "E", 1);
+	cap_var(&x->cbuf, ke->ident);
+	cap_var(&x->cbuf, ke->fflags);
+	cap_var(&x->cbuf, (uint32_t)ke->data);
+	cap_var(&x->cbuf, x->evtime);
+	if (x->cbuf.failed)
+		x->error = ENOMEM;
+	else
+		fwrite(x->cbuf.s, 1, x->cbuf.len, x->cap);
+	x->cbuf.len = 0;
+	x->cbuf.failed = 0;
+}
+
+/* apply one record of a capture, 1 and ke set if it is an event.  */
+static int
+rd_record(struct extrace *x, struct rcur *c, struct kevent *ke)
+{
+	struct rproc *r;
+	struct buf *b;
+	uint64_t v[6];
+	char **vec;
+	int type = *c->p++, i;
+	size_t n;
+	pid_t pid = rd_var(c);
+
+	if (type == 'E') {
+		for (i = 0; i < 3; i++)
+			v[i] = rd_var(c);
+		EV_SET(ke, pid, EVFILT_PROC, 0, v[0], (int)(uint32_t)v[1], 0);
+		x->evtime = v[2];
+		return 1;
+	}
+
+	if (!(r = rproc_get(x, pid, 1))) {
+		c->bad = 1;
+		return 0;
+	}
+	switch (type) {
+	case 'K':
+		for (i = 0; i < 6; i++)
+			v[i] = rd_var(c);
+		memset(&r->ki, 0, sizeof r->ki);
+		r->ki.ki_pid = pid;
+		r->ki.ki_ppid = v[0];
+		r->ki.ki_pgid = v[1];
+		r->ki.ki_uid = v[2];
+		r->ki.ki_ruid = v[3];
+		r->ki.ki_groups[0] = v[4];
+		r->ki.ki_jid = v[5];
+		snprintf(r->ki.ki_comm, sizeof r->ki.ki_comm, "%s", rd_str(c));
+		r->have |= R_KINFO;
+		break;
+	case 'A':
+	case 'V':
+		b = type == 'A' ? &r->argv : &r->envp;
+		if ((n = rd_var(c)) > (size_t)(c->end - c->p)) {
+			c->bad = 1;
+			break;
+		}
+		b->len = 0;
+		if (buf_grow(b, (n + 1) * sizeof (char *)) == -1) {
+			x->error = ENOMEM;
+			c->bad = 1;
+			break;
+		}
+		vec = (char **)b->s;
+		for (i = 0; i < (int)n; i++)
+			vec[i] = rd_str(c);
+		vec[n] = 0;
+		r->have |= type == 'A' ? R_ARGV : R_ENV;
+		break;
+	case 'P': r->path = rd_str(c); r->have |= R_PATH; break;
+	case 'C': r->cwd = rd_str(c); r->have |= R_CWD; break;
+	case 'k': r->have &= ~R_KINFO; break;
+	case 'a': r->have &= ~R_ARGV; break;
+	case 'v': r->have &= ~R_ENV; break;
+	case 'p': r->have &= ~R_PATH; break;
+	case 'c': r->have &= ~R_CWD; break;
+	default: c->bad = 1;
+	}
+	return 0;
+}
+
+static struct proc *
+proc_get(struct extrace *x, pid_t pid, int create)
+{
+	struct proc *p;
+
+	for (p = x->ptab[pid % PROC_BUCKETS]; p; p = p->next)
+		if (p->pid == pid)
+			return p;
+	if (!create)
+		return 0;
+
+	if (!(p = calloc(1, sizeof *p))) {
+		x->error = errno;
+		return 0;
+	}
+	p->pid = pid;
+	p->depth = -1;
+	p->next = x->ptab[pid % PROC_BUCKETS];
+	x->ptab[pid % PROC_BUCKETS] = p;
+	return p;
+}
+
+static void
+envset_release(struct extrace *x, struct envset *e)
+{
+	struct envset **ep;
+
+	if (!e || --e->refs > 0)
+		return;
+	for (ep = &x->etab[e->hash % ENV_BUCKETS]; *ep != e; ep = &(*ep)->next)
+		;
+	*ep = e->next;
+	x->envbytes -= e->size;
+	x->nenvsets--;
+	free(e);
+}
+
+static void
+proc_exit(struct extrace *x, pid_t pid)
+{
+	struct proc **pp, *p;
+
+	for (pp = &x->ptab[pid % PROC_BUCKETS]; (p = *pp); pp = &p->next)
+		if (p->pid == pid) {
+			*pp = p->next;
+			if (p->env)
+				x->nenvprocs--;
+			envset_release(x, p->env);
+			free(p);
+			return;
+		}
+}
+
+/* stop tracing an excluded process, but still see it exit.  */
+static void
+proc_untrack(struct extrace *x, pid_t pid)
+{
+	struct kevent kev;
+
+	if (x->flags & EXTRACE_REPLAY)
+		return;
+	EV_SET(&kev, pid, EVFILT_PROC, EV_ADD, NOTE_EXIT, 0, 0);
+	kevent(x->kq, &kev, 1, 0, 0, 0);
+}
+
+/* a traced process forked, the child inherits its classification.  */
+static void
+proc_fork(struct extrace *x, pid_t pid, pid_t ppid)
+{
+	struct proc *p, *c;
+
+	if (!(p = proc_get(x, ppid, 0)) || p->depth < 0)
+		return;
+	if (!(c = proc_get(x, pid, 1)))
+		return;
+	c->ppid = ppid;
+	if (c->depth != 0) {	/* roots keep their own */
+		c->depth = p->depth + 1;
+		c->excluded = p->excluded;
+	}
+	if (c->excluded)
+		proc_untrack(x, pid);
+}
+
+/*
+ * Depth of pid below the nearest root, -1 if it is excluded, or -2 if it
+ * cannot be told.  Usually the process or its parent is in the table
+ * already; otherwise walk up to the nearest known ancestor and remember
+ * the result.  An ancestor that exited during the walk left its children
+ * to init, so the depth is counted from there when init is a root; else
+ * the answer is not kept, a later event may find the parent known.
+ */
+static int
+proc_depth(struct extrace *x, pid_t pid, pid_t ppid)
+{
+	struct kinfo_proc *kp;
+	struct proc *p;
+	pid_t cur = pid, up = ppid;
+	int d, depth = -1, excluded = 1;
+
+	if ((p = proc_get(x, pid, 0)) && p->depth >= 0)
+		return p->excluded ? -1 : p->depth;
+
+	for (d = 0; ; d++) {
+		if ((p = proc_get(x, cur, 0)) && p->depth >= 0) {
+			depth = p->depth + d;
+			excluded = p->excluded;
+			break;
+		}
+		if (cur == 1)
+			break;  /* not below any root */
+		if (d > 0) {
+			if (!(kp = src_kinfo(x, cur))) {
+				if (!(p = proc_get(x, 1, 0)) || p->depth < 0)
+					return -2;
+				depth = p->depth + d;
+				excluded = p->excluded;
+				break;
+			}
+			up = kp->ki_ppid;
+		}
+		if (up <= 0)
+			break;
+		cur = up;
+	}
+
+	if (!(p = proc_get(x, pid, 1)))
+		return -2;
+	p->ppid = ppid;
+	p->depth = depth < 0 ? 0 : depth;
+	p->excluded = excluded;
+	if (excluded) {
+		proc_untrack(x, pid);
+		return -1;
+	}
+	return depth;
+}
+
+static int
+pgrp_excluded(struct extrace *x, pid_t pgid)
+{
+	size_t i;
+
+	for (i = 0; i < x->nxpgrp; i++)
+		if (x->xpgrp[i] == pgid)
+			return 1;
+	return 0;
+}
+
+/* pid is in an excluded process group, drop it and its subtree.  */
+static void
+proc_exclude(struct extrace *x, pid_t pid, pid_t ppid)
+{
+	struct proc *p;
+
+	if (!(p = proc_get(x, pid, 1)))
+		return;
+	p->ppid = ppid;
+	if (p->depth < 0)
+		p->depth = 0;
+	p->excluded = 1;
+	proc_untrack(x, pid);
+}
+
+static int
+envvar_cmp(const void *a, const void *b)
+{
+	const struct envvar *va = a, *vb = b;
+	int r;
+
+	if (va->khash != vb->khash)
+		return va->khash < vb->khash ? -1 : 1;
+	if ((r = memcmp(va->key, vb->key,
+	    va->klen < vb->klen ? va->klen : vb->klen)))
+		return r;
+	return va->klen < vb->klen ? -1 : va->klen > vb->klen;
+}
+
+/* find or create the envset holding the n sorted variables in v.  */
+static struct envset *
+envset_get(struct extrace *x, struct envvar *v, size_t n)
+{
+	struct envset *e;
+	uint32_t h = 2166136261u;
+	size_t i, size;
+	char *p;
+
+	for (i = 0; i < n; i++)
+		h = (h ^ v[i].ehash) * 16777619u;
+
+	for (e = x->etab[h % ENV_BUCKETS]; e; e = e->next) {
+		if (e->hash != h || e->n != n)
+			continue;
+		for (i = 0; i < n; i++)
+			if (e->vars[i].ehash != v[i].ehash ||
+			    envvar_cmp(&e->vars[i], &v[i]) != 0)
+				break;
+		if (i == n) {
+			e->refs++;
+			return e;
+		}
+	}
+
+	size = sizeof *e + n * sizeof *v;
+	for (i = 0; i < n; i++)
+		size += v[i].klen;
+	if (x->envbytes + size > ENV_BYTES) {
+		x->envsets_dropped++;
+		return 0;
+	}
+	if (!(e = malloc(size))) {
+		x->error = errno;
+		return 0;
+	}
+	e->hash = h;
+	e->refs = 1;
+	e->n = n;
+	e->size = size;
+	p = (char *)&e->vars[n];
+	for (i = 0; i < n; i++) {
+		e->vars[i] = v[i];
+		e->vars[i].key = memcpy(p, v[i].key, v[i].klen);
+		p += v[i].klen;
+	}
+	e->next = x->etab[h % ENV_BUCKETS];
+	x->etab[h % ENV_BUCKETS] = e;
+	x->nenvsets++;
+	if ((x->envbytes += size) > x->envbytes_max)
+		x->envbytes_max = x->envbytes;
+	return e;
+}
+
+/* environment of the process itself or its nearest traced ancestor.  */
+static struct envset *
+env_base(struct extrace *x, pid_t pid, pid_t ppid)
+{
+	struct kinfo_proc *kp;
+	struct proc *p;
+
+	if ((p = proc_get(x, pid, 0)) && p->env)
+		return p->env;
+	while (ppid > 1) {
+		if ((p = proc_get(x, ppid, 0))) {
+			if (p->env)
+				return p->env;
+			ppid = p->ppid;
+			continue;
+		}
+		if (!(kp = src_kinfo(x, ppid)))
+			break;
+		ppid = kp->ki_ppid;
+	}
+	return 0;
+}
+
+/*
+ * Replace ev->envp by the variables that were added or changed relative
+ * to the environment of the nearest traced ancestor, and set ev->unset to
+ * the removed ones.  Returns the envset of the new environment, which the
+ * caller attaches to the process after the callback.
+ */
+static struct envset *
+env_diff_event(struct extrace *x, struct exec_event *ev)
+{
+	struct envset *base, *e;
+	size_t n, i, j, ns = 0, nu = 0;
+	void *v;
+	char *eq;
+
+	n = ev->envc;
+	if (n > x->curcap) {
+		if (!(v = realloc(x->cur, n * sizeof *x->cur)))
+			goto fail;
+		x->cur = v;
+		x->curcap = n;
+	}
+	for (i = 0; i < n; i++) {
+		x->cur[i].key = ev->envp[i];
+		eq = strchr(ev->envp[i], '=');
+		x->cur[i].klen = eq ? (size_t)(eq - ev->envp[i]) : strlen(ev->envp[i]);
+		x->cur[i].khash = hash_bytes(x->cur[i].key, x->cur[i].klen);
+		x->cur[i].ehash = hash_bytes(ev->envp[i], strlen(ev->envp[i]));
+	}
+	qsort(x->cur, n, sizeof *x->cur, envvar_cmp);
+
+	base = env_base(x, ev->pid, ev->ppid);
+	if (n + 1 > x->setcap) {
+		if (!(v = realloc(x->set, (n + 1) * sizeof *x->set)))
+			goto fail;
+		x->set = v;
+		x->setcap = n + 1;
+	}
+	if (base && base->n + 1 > x->unsetcap) {
+		if (!(v = realloc(x->unset, (base->n + 1) * sizeof *x->unset)))
+			goto fail;
+		x->unset = v;
+		x->unsetcap = base->n + 1;
+	}
+
+	/* merge the two sorted lists.  */
+	x->ubuf.len = 0;
+	for (i = j = 0; i < n || (base && j < base->n); ) {
+		int c = !base || j == base->n ? -1 :
+		    i == n ? 1 : envvar_cmp(&x->cur[i], &base->vars[j]);
+		if (c < 0) {
+			x->set[ns++] = x->cur[i++].key;
+		} else if (c > 0) {
+			/* keys in the envset are not NUL-terminated.  */
+			buf_put(&x->ubuf, base->vars[j].key, base->vars[j].klen);
+			buf_put(&x->ubuf, "", 1);
+			nu++, j++;
+		} else {
+			if (x->cur[i].ehash != base->vars[j].ehash)
+				x->set[ns++] = x->cur[i].key;
+			i++, j++;
+		}
+	}
+	if (x->ubuf.failed) {
+		x->ubuf.failed = 0;
+		goto fail;
+	}
+	x->set[ns] = 0;
+	for (i = 0, eq = x->ubuf.s; i < nu; i++, eq += strlen(eq) + 1)
+		x->unset[i] = eq;
+	if (x->unset)
+		x->unset[nu] = 0;
+
+	e = envset_get(x, x->cur, n);
+
+	ev->flags |= EXTRACE_ENVDIFF;
+	ev->envp = x->set;
+	ev->envc = ns;
+	ev->unset = x->unset;
+	ev->unsetc = nu;
+	return e;
+
+fail:
+	/* the event keeps its whole environment.  */
+	x->error = ENOMEM;
+	return 0;
+}
+
+static int
+femit(struct fparse *fp, int op)
+{
+	struct extrace_filter *f = fp->f;
+	struct fins *code;
+
+	if (f->n == f->cap) {
+		if (!(code = realloc(f->code,
+		    (f->cap ? 2*f->cap : 16) * sizeof *f->code)))
+			return fp->err = "out of memory", -1;
+		f->code = code;
+		f->cap = f->cap ? 2*f->cap : 16;
+	}
+	memset(&f->code[f->n], 0, sizeof f->code[0]);
+	f->code[f->n].op = op;
+	return f->n++;
+}
+
+static void
+fskip(struct fparse *fp)
+{
+	while (isspace((unsigned char)*fp->p))
+		fp->p++;
+}
+
+/* consume the keyword or parenthesis kw if it comes next.  */
+static int
+fword(struct fparse *fp, const char *kw)
+{
+	size_t n = strlen(kw);
+
+	fskip(fp);
+	if (strncmp(fp->p, kw, n) != 0 ||
+	    (isalpha((unsigned char)*kw) && isalnum((unsigned char)fp->p[n])))
+		return 0;
+	fp->p += n;
+	return 1;
+}
+
+static int fexpr(struct fparse *);
+
+/* field op value, or a parenthesized expression.  */
+static int
+fprimary(struct fparse *fp)
+{
+	struct fins *f;
+	const char *name, *v;
+	char *end;
+	size_t n;
+	int key, cmp, i;
+
+	if (fword(fp, "(")) {
+		if (fexpr(fp) == -1)
+			return -1;
+		if (!fword(fp, ")"))
+			return fp->err = "expected )", -1;
+		return 0;
+	}
+
+	for (name = fp->p; isalpha((unsigned char)*fp->p); fp->p++)
+		;
+	n = fp->p - name;
+	for (key = 0; key < (int)(sizeof fkeys / sizeof fkeys[0]); key++)
+		if (strlen(fkeys[key].name) == n &&
+		    strncmp(fkeys[key].name, name, n) == 0)
+			break;
+	if (key == sizeof fkeys / sizeof fkeys[0]) {
+		fp->p = name;
+		return fp->err = n ? "unknown field" : "expected field", -1;
+	}
+
+	/* longest operator first.  */
+	for (cmp = -1, i = 0; i < (int)(sizeof fcmps / sizeof fcmps[0]); i++)
+		if (strncmp(fp->p, fcmps[i], strlen(fcmps[i])) == 0 &&
+		    (cmp == -1 || strlen(fcmps[i]) > strlen(fcmps[cmp])))
+			cmp = i;
+	if (cmp == -1)
+		return fp->err = "expected operator", -1;
+	fp->p += strlen(fcmps[cmp]);
+
+	if (*fp->p == '\'' || *fp->p == '"') {
+		v = ++fp->p;
+		if (!(fp->p = strchr(v, v[-1]))) {
+			fp->p = v - 1;
+			return fp->err = "unterminated quote", -1;
+		}
+		n = fp->p++ - v;
+	} else {
+		for (v = fp->p; *fp->p && !isspace((unsigned char)*fp->p) &&
+		    *fp->p != '(' && *fp->p != ')'; fp->p++)
+			;
+		n = fp->p - v;
+	}
+
+	if ((i = femit(fp, F_PRED)) == -1)
+		return -1;
+	f = &fp->f->code[i];
+	f->key = key;
+	if (!(f->str = strndup(v, n)))
+		return fp->err = "out of memory", -1;
+	f->cmp = cmp;
+	fp->f->stages |= 1 << fkeys[key].stage;
+
+	v = fp->p;
+	fp->p = name;  /* for errors */
+	if (fkeys[key].isstr) {
+		if (cmp != C_EQ && cmp != C_NE && cmp != C_MATCH && cmp != C_NOMATCH)
+			return fp->err = "bad operator for string", -1;
+		if ((cmp == C_MATCH || cmp == C_NOMATCH) &&
+		    regcomp(&f->re, f->str, REG_EXTENDED | REG_NOSUB) != 0) {
+			f->cmp = C_EQ;  /* nothing to free */
+			return fp->err = "bad regular expression", -1;
+		}
+	} else {
+		if (cmp == C_MATCH || cmp == C_NOMATCH ||
+		    (key == K_UNDER && cmp != C_EQ && cmp != C_NE))
+			return fp->err = "bad operator for number", -1;
+		f->num = strtol(f->str, &end, 10);
+		if (!*f->str || *end)
+			return fp->err = "bad number", -1;
+	}
+	fp->p = v;
+	return 0;
+}
+
+static int
+fnot(struct fparse *fp)
+{
+	if (fword(fp, "not")) {
+		if (fnot(fp) == -1)
+			return -1;
+		return femit(fp, F_NOT) == -1 ? -1 : 0;
+	}
+	return fprimary(fp);
+}
+
+static int
+fand(struct fparse *fp)
+{
+	if (fnot(fp) == -1)
+		return -1;
+	while (fword(fp, "and")) {
+		if (fnot(fp) == -1 || femit(fp, F_AND) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+fexpr(struct fparse *fp)
+{
+	if (fand(fp) == -1)
+		return -1;
+	while (fword(fp, "or")) {
+		if (fand(fp) == -1 || femit(fp, F_OR) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+fpred(struct extrace *x, const struct fins *f, const struct fvals *fv)
+{
+	const char *s = 0;
+	long v = 0;
+
+	switch (f->key) {
+	case K_UID: v = fv->kp->ki_uid; break;
+	case K_GID: v = fv->kp->ki_groups[0]; break;
+	case K_JAIL: v = fv->kp->ki_jid; break;
+	case K_PID: v = fv->kp->ki_pid; break;
+	case K_PPID: v = fv->kp->ki_ppid; break;
+	case K_DEPTH: v = fv->depth; break;
+	case K_UNDER:
+		v = extrace_depth(x, fv->kp->ki_pid, fv->kp->ki_ppid, f->num) >= 0;
+		return f->cmp == C_EQ ? v : !v;
+	case K_COMM: s = fv->kp->ki_comm; break;
+	case K_EXE: s = fv->exe ? fv->exe : ""; break;
+	case K_ARGV: s = fv->args; break;
+	}
+
+	switch (f->cmp) {
+	case C_EQ: return s ? fnmatch(f->str, s, 0) == 0 : v == f->num;
+	case C_NE: return s ? fnmatch(f->str, s, 0) != 0 : v != f->num;
+	case C_LT: return v < f->num;
+	case C_LE: return v <= f->num;
+	case C_GT: return v > f->num;
+	case C_GE: return v >= f->num;
+	case C_MATCH: return regexec(&f->re, s, 0, 0, 0) == 0;
+	case C_NOMATCH: return regexec(&f->re, s, 0, 0, 0) != 0;
+	}
+	return 0;
+}
+
+/* 0 false, 1 true, 2 unknown with the fields known so far.  */
+static int
+filter_eval(struct extrace *x, const struct extrace_filter *fl,
+    const struct fvals *fv)
+{
+	char *st = fl->stack;
+	size_t i;
+	int sp = 0, a, b;
+
+	for (i = 0; i < fl->n; i++) {
+		const struct fins *f = &fl->code[i];
+		switch (f->op) {
+		case F_PRED:
+			st[sp++] = fkeys[f->key].stage > fv->stage ? 2 :
+			    fpred(x, f, fv);
+			break;
+		case F_NOT:
+			if (st[sp-1] != 2)
+				st[sp-1] = !st[sp-1];
+			break;
+		case F_AND:
+			a = st[--sp - 1], b = st[sp];
+			st[sp-1] = !a || !b ? 0 : a == 1 && b == 1 ? 1 : 2;
+			break;
+		case F_OR:
+			a = st[--sp - 1], b = st[sp];
+			st[sp-1] = a == 1 || b == 1 ? 1 : !a && !b ? 0 : 2;
+			break;
+		}
+	}
+	return st[0];
+}
+
+/* run the filter on the fields up to stage, 1 if the event is dropped.  */
+static int
+filter_drop(struct extrace *x, struct fvals *fv, int stage)
+{
+	if (!x->filter.n || fv->done)
+		return 0;
+	fv->stage = stage;
+	switch (filter_eval(x, &x->filter, fv)) {
+	case 0:
+		x->filtered++;
+		return 1;
+	case 1:
+		fv->done = 1;
+		break;
+	}
+	return 0;
+}
+
+static void
+filter_free(struct extrace_filter *f)
+{
+	size_t i;
+
+	for (i = 0; i < f->n; i++) {
+		if (f->code[i].op == F_PRED && (f->code[i].cmp == C_MATCH ||
+		    f->code[i].cmp == C_NOMATCH))
+			regfree(&f->code[i].re);
+		free(f->code[i].str);
+	}
+	free(f->code);
+	free(f->stack);
+	f->code = 0;
+	f->stack = 0;
+	f->n = f->cap = 0;
+	f->stages = 0;
+}
+
+/* compile expr into f, -1 with *errstr set on error.  */
+static int
+filter_compile(struct extrace *x, struct extrace_filter *f, const char *expr,
+    const char **errstr)
+{
+	struct fparse fp = { x, f, expr, expr, 0 };
+
+	filter_free(f);
+	if (fexpr(&fp) == 0) {
+		fskip(&fp);
+		if (*fp.p)
+			fp.err = "unexpected input";
+	}
+	if (fp.err) {
+		snprintf(x->ferr, sizeof x->ferr, "%s at '%.20s'", fp.err, fp.p);
+		*errstr = x->ferr;
+		filter_free(f);
+		return -1;
+	}
+	if (!(f->stack = malloc(f->n))) {
+		*errstr = "out of memory";
+		filter_free(f);
+		return -1;
+	}
+	return 0;
+}
+
+/* do the undecided filter or any matcher still need fields of stage?  */
+static int
+filter_needs(struct extrace *x, struct fvals *fv, int stage)
+{
+	return (x->filter.n && !fv->done && x->filter.stages & (1 << stage)) ||
+	    x->mstages & (1 << stage);
+}
+
+static uint32_t
+ac_goto(struct extrace *x, uint32_t s, unsigned char c)
+{
+	uint32_t key = (s << 8 | c) + 1;
+	size_t i;
+
+	if (!x->acedges)
+		return 0;
+	for (i = key * 2654435761u & x->acmask; x->acedges[i].key;
+	    i = (i + 1) & x->acmask)
+		if (x->acedges[i].key == key)
+			return x->acedges[i].to;
+	return 0;
+}
+
+static int
+ac_edge(struct extrace *x, uint32_t s, unsigned char c, uint32_t to)
+{
+	struct acedge *old = x->acedges;
+	size_t i, oldsize = old ? x->acmask + 1 : 0;
+	uint32_t key = (s << 8 | c) + 1;
+
+	if (2 * (x->nacedges + 1) > oldsize) {
+		if (!(x->acedges = calloc(oldsize ? 2 * oldsize : 1024,
+		    sizeof *x->acedges))) {
+			x->acedges = old;
+			return -1;
+		}
+		x->acmask = oldsize ? 2 * oldsize - 1 : 1023;
+		x->nacedges = 0;
+		for (i = 0; i < oldsize; i++)
+			if (old[i].key)
+				ac_edge(x, (old[i].key - 1) >> 8,
+				    (old[i].key - 1) & 0xff, old[i].to);
+		free(old);
+	}
+	for (i = key * 2654435761u & x->acmask; x->acedges[i].key;
+	    i = (i + 1) & x->acmask)
+		;
+	x->acedges[i].key = key;
+	x->acedges[i].to = to;
+	x->nacedges++;
+	return 0;
+}
+
+/* a new state, or 0 if out of memory.  */
+static uint32_t
+ac_state(struct extrace *x, uint32_t parent, unsigned char c)
+{
+	struct acstate *a;
+
+	if (x->nacs == x->acscap) {
+		if (!(a = realloc(x->acs,
+		    (x->acscap ? 2*x->acscap : 1024) * sizeof *x->acs)))
+			return 0;
+		x->acs = a;
+		x->acscap = x->acscap ? 2*x->acscap : 1024;
+	}
+	a = &x->acs[x->nacs];
+	memset(a, 0, sizeof *a);
+	a->parent = parent;
+	a->c = c;
+	a->depth = x->nacs ? x->acs[parent].depth + 1 : 0;
+	return x->nacs++;
+}
+
+struct tagsort {
+	const char *tag;
+	uint32_t id;
+};
+
+static int
+tag_cmp(const void *a, const void *b)
+{
+	const struct tagsort *ta = a, *tb = b;
+	int r = strcmp(ta->tag, tb->tag);
+
+	if (r)
+		return r;
+	return ta->id < tb->id ? -1 : 1;
+}
+
+/* compute failure and dictionary links, breadth first.  */
+static int
+ac_build(struct extrace *x)
+{
+	uint32_t *order = 0, *count, f, g;
+	struct tagsort *ts = 0;
+	size_t i, maxdepth = 0;
+
+	for (i = 0; i < x->nacs; i++)
+		if (x->acs[i].depth > maxdepth)
+			maxdepth = x->acs[i].depth;
+	if (!(count = calloc(maxdepth + 2, sizeof *count)) ||
+	    !(order = malloc(x->nacs * sizeof *order)) ||
+	    !(ts = malloc(x->npats * sizeof *ts))) {
+		free(count);
+		free(order);
+		return -1;
+	}
+	for (i = 0; i < x->nacs; i++)
+		count[x->acs[i].depth + 1]++;
+	for (i = 1; i <= maxdepth + 1; i++)
+		count[i] += count[i-1];
+	for (i = 0; i < x->nacs; i++)
+		order[count[x->acs[i].depth]++] = i;
+
+	for (i = 1; i < x->nacs; i++) {
+		struct acstate *a = &x->acs[order[i]];
+		g = 0;
+		if (a->parent)
+			for (f = x->acs[a->parent].fail; ; f = x->acs[f].fail)
+				if ((g = ac_goto(x, f, a->c)) || !f)
+					break;
+		a->fail = g;
+		a->dict = x->acs[g].pat ? g : x->acs[g].dict;
+	}
+	for (i = 0; i < 256; i++)
+		x->acroot[i] = ac_goto(x, 0, i);
+
+	/* patterns with the same tag report it once.  */
+	for (i = 0; i < x->npats; i++) {
+		ts[i].tag = x->pattag[i];
+		ts[i].id = i;
+	}
+	qsort(ts, x->npats, sizeof *ts, tag_cmp);
+	for (i = 0; i < x->npats; i++)
+		x->tagid[ts[i].id] = i && strcmp(ts[i].tag, ts[i-1].tag) == 0 ?
+		    x->tagid[ts[i-1].id] : ts[i].id;
+
+	free(ts);
+	free(order);
+	free(count);
+	x->acbuilt = 1;
+	return 0;
+}
+
+static void
+tag_hit(struct extrace *x, uint32_t pat)
+{
+	uint32_t id = x->tagid[pat];
+
+	if (x->tagseen[id] == x->tagstamp)
+		return;
+	x->tagseen[id] = x->tagstamp;
+	x->tagv[x->ntagv++] = x->pattag[id];
+}
+
+static void
+tag_strv(struct extrace *x, char **v)
+{
+	struct timespec t0, t1;
+	const unsigned char *p;
+	uint32_t st, n = 0, o;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (; *v; v++) {
+		st = 0;
+		for (p = (const unsigned char *)*v; *p; p++) {
+			while (st && !(n = ac_goto(x, st, *p)))
+				st = x->acs[st].fail;
+			st = st ? n : x->acroot[*p];
+			for (o = x->acs[st].pat ? st : x->acs[st].dict; o;
+			    o = x->acs[o].dict)
+				tag_hit(x, x->acs[o].pat - 1);
+		}
+		x->tag_bytes += p - (const unsigned char *)*v;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	x->tag_ns += (t1.tv_sec - t0.tv_sec) * 1000000000LL +
+	    (t1.tv_nsec - t0.tv_nsec);
+}
+
+static struct bucket *
+limit_bucket(struct limit *l, const struct kinfo_proc *kp, uint64_t now)
+{
+	struct bucket *b;
+	uint32_t h = 0;
+
+	switch (l->kind) {
+	case EXTRACE_LIMIT_UID: h = kp->ki_ruid; break;
+	case EXTRACE_LIMIT_COMM: h = hash_bytes(kp->ki_comm, strlen(kp->ki_comm)); break;
+	}
+	for (b = l->tab[h % LIMIT_BUCKETS]; b; b = b->next)
+		if (b->hash == h && (l->kind != EXTRACE_LIMIT_UID ||
+		    b->uid == kp->ki_ruid) && (l->kind != EXTRACE_LIMIT_COMM ||
+		    strcmp(b->comm, kp->ki_comm) == 0))
+			return b;
+
+	if (!(b = calloc(1, sizeof *b)))
+		return 0;
+	b->hash = h;
+	b->uid = kp->ki_ruid;
+	if (l->kind == EXTRACE_LIMIT_COMM)
+		memcpy(b->comm, kp->ki_comm, sizeof b->comm);
+	b->tokens = l->burst * 1000000000;
+	b->last = now;
+	b->next = l->tab[h % LIMIT_BUCKETS];
+	l->tab[h % LIMIT_BUCKETS] = b;
+	return b;
+}
+
+static void
+bucket_refill(struct limit *l, struct bucket *b, uint64_t now)
+{
+	uint64_t full = l->burst * 1000000000;
+
+	if (now > b->last) {
+		if (now - b->last >= full / l->rate)
+			b->tokens = full;
+		else if ((b->tokens += (now - b->last) * l->rate) > full)
+			b->tokens = full;
+	}
+	b->last = now;
+}
+
+/*
+ * Sample and rate limit by the kinfo alone, 1 if the event is dropped.
+ * A token is only taken from the buckets if all of them have one.
+ */
+static int
+limit_drop(struct extrace *x, const struct kinfo_proc *kp, uint64_t now)
+{
+	struct bucket *b[MAXLIMITS];
+	size_t i;
+
+	if (x->sample > 1 && x->samplen++ % x->sample != 0) {
+		x->sampled++;
+		return 1;
+	}
+	for (i = 0; i < x->nlimits; i++) {
+		if (!(b[i] = limit_bucket(&x->limits[i], kp, now))) {
+			x->error = errno;
+			return 0;
+		}
+		bucket_refill(&x->limits[i], b[i], now);
+		if (b[i]->tokens < 1000000000) {
+			b[i]->suppressed++;
+			x->suppressed++;
+			return 1;
+		}
+	}
+	for (i = 0; i < x->nlimits; i++)
+		b[i]->tokens -= 1000000000;
+	return 0;
+}
+
+static void
+handle_msg(struct extrace *x, pid_t pid)
+{
+	struct exec_event ev = { 0 };
+	struct kinfo_proc *kp, ki;
+	struct kinfo_file info;
+	struct fvals fv = { 0 };
+	char path[PATH_MAX];
+	char *argv0[2];
+	struct envset *env = 0;
+	struct proc *p;
+	uint64_t t0, t;
+	char **pp;
+	int n;
+
+	ev.time = x->evtime;
+	ev.pid = pid;
+	ev.depth = -1;
+	t0 = t = mono_ns();
+
+	/* the process may be gone already.  */
+	if (!(kp = src_kinfo(x, pid))) {
+		x->races++;
+		return;
+	}
+	ki = *kp;  /* kvm reuses the storage on the next call */
+	lap(x, EXTRACE_T_KINFO, &t);
+	ev.ppid = ki.ki_ppid;
+	fv.kp = &ki;
+	fv.depth = -1;
+	if (x->nxpgrp && pgrp_excluded(x, ki.ki_pgid)) {
+		proc_exclude(x, pid, ev.ppid);
+		return;
+	}
+	if (x->tree) {
+		if ((fv.depth = proc_depth(x, pid, ev.ppid)) == -1)
+			return;
+		if (fv.depth < 0)
+			fv.depth = -1;	/* unknown, but traced */
+		if (!(x->flags & EXTRACE_FLAT))
+			ev.depth = fv.depth;
+		lap(x, EXTRACE_T_TREE, &t);
+	}
+	if (filter_drop(x, &fv, S_KINFO))
+		return;
+	if (filter_drop(x, &fv, S_TREE))
+		return;
+	if ((x->nlimits || x->sample) && limit_drop(x, &ki, ev.time))
+		return;
+
+	if (x->flags & EXTRACE_PATH || filter_needs(x, &fv, S_EXE)) {
+		fv.exe = src_path(x, pid, path, sizeof path);
+		if (x->flags & EXTRACE_PATH) {
+			ev.flags |= EXTRACE_PATH;
+			ev.path = (char *)fv.exe;
+		}
+		lap(x, EXTRACE_T_PATH, &t);
+	}
+	if (filter_drop(x, &fv, S_EXE))
+		return;
+
+	if (!(pp = src_strv(x, &ki, 0))) {
+		x->races++;
+		return;
+	}
+	if (filter_needs(x, &fv, S_ARGV)) {
+		x->jbuf.len = 0;
+		for (n = 0; pp[n]; n++) {
+			if (n)
+				buf_put(&x->jbuf, " ", 1);
+			buf_put(&x->jbuf, pp[n], strlen(pp[n]));
+		}
+		buf_put(&x->jbuf, "", 1);
+		if (x->jbuf.failed) {
+			x->jbuf.failed = 0;
+			x->error = ENOMEM;
+			return;
+		}
+		fv.args = x->jbuf.s;
+	}
+	if (filter_drop(x, &fv, S_ARGV))
+		return;
+	if (x->npats) {
+		x->tagstamp++;
+		x->ntagv = 0;
+		tag_strv(x, pp);
+	}
+	if (x->flags & EXTRACE_ARGV0 && *pp) {
+		/* only argv[0] is wanted, drop the rest early.  */
+		argv0[0] = *pp;
+		argv0[1] = 0;
+		pp = argv0;
+	}
+	ev.argv = pp;
+	lap(x, EXTRACE_T_ARGV, &t);
+
+	if (x->flags & EXTRACE_CWD) {
+		ev.flags |= EXTRACE_CWD;
+		ev.cwd = src_cwd(x, pid, &info);
+		lap(x, EXTRACE_T_CWD, &t);
+	}
+
+	if (x->flags & EXTRACE_ENV) {
+		/* kvm_getenvv() may reuse the storage of kvm_getargv().  */
+		if (!(ev.argv = save_strv(&x->abuf, ev.argv))) {
+			x->error = ENOMEM;
+			return;
+		}
+		ev.flags |= EXTRACE_ENV;
+		ev.envp = src_strv(x, &ki, 1);
+		ev.envc = strv_len(ev.envp);
+		if (x->npats && ev.envp)
+			tag_strv(x, ev.envp);
+		if (x->flags & EXTRACE_ENVDIFF && ev.envp)
+			env = env_diff_event(x, &ev);
+		lap(x, EXTRACE_T_ENV, &t);
+	}
+	ev.argc = strv_len(ev.argv);
+	if (x->npats) {
+		ev.flags |= EXTRACE_TAGS;
+		x->tagv[x->ntagv] = 0;
+		ev.tags = x->tagv;
+		ev.tagc = x->ntagv;
+		if (x->ntagv)
+			x->tagged++;
+	}
+
+	x->events++;
+	fv.stage = S_ARGV;
+	x->curfv = &fv;
+	x->cb(&ev, x->arg);
+	x->curfv = 0;
+	lap(x, EXTRACE_T_CB, &t);
+	extrace_hist_add(&x->times[EXTRACE_T_EVENT], t - t0);
+
+	if (x->flags & EXTRACE_ENVDIFF && ev.envp) {
+		if (!(p = proc_get(x, pid, 1))) {
+			envset_release(x, env);
+			return;
+		}
+		p->ppid = ev.ppid;
+		if (p->env && !env)
+			x->nenvprocs--;
+		else if (!p->env && env)
+			x->nenvprocs++;
+		envset_release(x, p->env);
+		p->env = env;
+	}
+}
+
+struct extrace *
+extrace_open(int flags, extrace_cb *cb, void *arg)
+{
+	struct extrace *x;
+
+	if (!(x = calloc(1, sizeof *x)))
+		return 0;
+	if (flags & EXTRACE_ENVDIFF)
+		flags |= EXTRACE_ENV;
+	x->flags = flags;
+	x->cb = cb;
+	x->arg = arg;
+	x->tree = !(flags & EXTRACE_FLAT);
+
+	if ((x->kq = kqueue()) == -1) {
+		free(x);
+		return 0;
+	}
+	if (!(flags & EXTRACE_REPLAY) &&
+	    !(x->kd = kvm_openfiles(0, 0, 0, O_RDONLY, 0))) {
+		close(x->kq);
+		free(x);
+		return 0;
+	}
+	return x;
+}
+
+/* add a root, pid 1 is the parent of all processes.  */
+static int
+proc_root(struct extrace *x, pid_t pid, int excluded)
+{
+	struct proc *p;
+
+	if (!(p = proc_get(x, pid, 1)))
+		return -1;
+	p->depth = 0;
+	p->excluded = excluded;
+	return 0;
+}
+
+/*
+ * Do not trace the descendants of pid, nor pid itself.  Must be called
+ * before extrace_trace().
+ */
+int
+extrace_exclude(struct extrace *x, pid_t pid)
+{
+	struct kevent kev;
+
+	EV_SET(&kev, pid, EVFILT_PROC, EV_ADD, NOTE_EXIT, 0, 0);
+	if (!(x->flags & EXTRACE_REPLAY) && kevent(x->kq, &kev, 1, 0, 0, 0) == -1)
+		return -1;
+	if (!(x->excl = realloc(x->excl, (x->nexcl + 1) * sizeof *x->excl)))
+		return -1;
+	x->excl[x->nexcl++] = pid;
+	x->tree = 1;
+	return proc_root(x, pid, 1);
+}
+
+/*
+ * Do not trace processes in process group pgid, nor their descendants.
+ * They are recognized when they call exec(), whatever their parent.
+ * Must be called before extrace_trace().
+ */
+int
+extrace_exclude_pgrp(struct extrace *x, pid_t pgid)
+{
+	if (!(x->xpgrp = realloc(x->xpgrp, (x->nxpgrp + 1) * sizeof *x->xpgrp)))
+		return -1;
+	x->xpgrp[x->nxpgrp++] = pgid;
+	x->tree = 1;
+	return 0;
+}
+
+/* the open files of pid, as packed kinfo_file records of *len bytes.  */
+static char *
+proc_files(pid_t pid, size_t *len)
+{
+	int name[] = { CTL_KERN, KERN_PROC, KERN_PROC_FILEDESC, pid };
+	char *buf;
+
+	if (sysctl(name, 4, 0, len, 0, 0) == -1)
+		return 0;
+	*len += *len / 4;  /* files may be opened meanwhile */
+	if (!(buf = malloc(*len)))
+		return 0;
+	if (sysctl(name, 4, buf, len, 0, 0) == -1) {
+		free(buf);
+		return 0;
+	}
+	return buf;
+}
+
+/* the kernel address of the pipe on fd of pid, or 0.  */
+static uint64_t
+pipe_addr(pid_t pid, int fd, uint64_t peer)
+{
+	struct kinfo_file *kf;
+	uint64_t addr = 0;
+	size_t len, off;
+	char *buf;
+
+	if (!(buf = proc_files(pid, &len)))
+		return 0;
+	for (off = 0; off < len; off += kf->kf_structsize) {
+		kf = (struct kinfo_file *)(buf + off);
+		if (kf->kf_structsize <= 0)
+			break;
+		if (kf->kf_type != KF_TYPE_PIPE)
+			continue;
+		if (fd >= 0 ? kf->kf_fd == fd :
+		    kf->kf_un.kf_pipe.kf_pipe_addr == peer ||
+		    kf->kf_un.kf_pipe.kf_pipe_peer == peer) {
+			addr = kf->kf_un.kf_pipe.kf_pipe_addr;
+			break;
+		}
+	}
+	free(buf);
+	return addr;
+}
+
+/*
+ * Do not trace the other processes of our process group that have the
+ * pipe on our fd open, nor their descendants.  Must be called before
+ * extrace_trace().
+ */
+int
+extrace_exclude_pipe(struct extrace *x, int fd)
+{
+	struct kinfo_proc *kp;
+	uint64_t addr;
+	pid_t self = getpid();
+	int i, n;
+
+	if (x->flags & EXTRACE_REPLAY)
+		return 0;
+	if (!(addr = pipe_addr(self, fd, 0)))
+		return -1;
+	if (!(kp = kvm_getprocs(x->kd, KERN_PROC_PGRP, getpgrp(), &n)))
+		return -1;
+	for (i = 0; i < n; i++)
+		if (kp[i].ki_pid != self && kp[i].ki_stat != SZOMB &&
+		    pipe_addr(kp[i].ki_pid, -1, addr) &&
+		    extrace_exclude(x, kp[i].ki_pid) == -1 && errno != ESRCH)
+			return -1;
+	return 0;
+}
+
+/*
+ * Deliver at most rate events per second, and bursts of up to burst,
+ * in total or for each uid or comm as given by kind.  Several limits
+ * can be combined, an event then has to pass all of them.
+ */
+int
+extrace_limit(struct extrace *x, int kind, unsigned rate, unsigned burst)
+{
+	struct limit *l;
+
+	if (kind < EXTRACE_LIMIT_ALL || kind > EXTRACE_LIMIT_COMM ||
+	    !rate || x->nlimits == MAXLIMITS) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!(l = realloc(x->limits, (x->nlimits + 1) * sizeof *l)))
+		return -1;
+	x->limits = l;
+	l = &x->limits[x->nlimits++];
+	memset(l, 0, sizeof *l);
+	l->kind = kind;
+	l->rate = rate;
+	l->burst = burst ? burst : rate;
+	return 0;
+}
+
+/* only deliver every n-th event; it is checked before the limits.  */
+void
+extrace_sample(struct extrace *x, unsigned n)
+{
+	x->sample = n;
+}
+
+/*
+ * Call cb for each bucket that dropped events since the last call,
+ * with its uid or comm as key, and reset the counts.  Buckets that
+ * are full again are forgotten.
+ */
+void
+extrace_suppressed(struct extrace *x, extrace_suppressed_cb *cb, void *arg)
+{
+	struct bucket **bp, *b;
+	struct limit *l;
+	uint64_t now = now_ns();
+	char key[32];
+	size_t i, j;
+
+	for (i = 0; i < x->nlimits; i++) {
+		l = &x->limits[i];
+		for (j = 0; j < LIMIT_BUCKETS; j++) {
+			for (bp = &l->tab[j]; (b = *bp); ) {
+				if (b->suppressed) {
+					if (l->kind == EXTRACE_LIMIT_UID)
+						snprintf(key, sizeof key, "%d", (int)b->uid);
+					cb(l->kind, l->kind == EXTRACE_LIMIT_UID ? key :
+					    b->comm, b->suppressed, arg);
+					b->suppressed = 0;
+				}
+				bucket_refill(l, b, now);
+				if (b->tokens == l->burst * 1000000000) {
+					*bp = b->next;
+					free(b);
+				} else {
+					bp = &b->next;
+				}
+			}
+		}
+	}
+}
+
+/* call cb with the parent when a traced process forks a child.  */
+void
+extrace_forks(struct extrace *x, extrace_fork_cb *cb, void *arg)
+{
+	x->forkcb = cb;
+	x->forkarg = arg;
+}
+
+/*
+ * Call cb with the wait status when a traced process exits, whether or
+ * not it called exec().  Must be called before extrace_trace().
+ */
+void
+extrace_exits(struct extrace *x, extrace_exit_cb *cb, void *arg)
+{
+	x->exitcb = cb;
+	x->exitarg = arg;
+}
+
+/*
+ * Trace the descendants of pid, or all processes if pid is 1.  May be
+ * called for several roots, depth is counted from the nearest one.
+ */
+int
+extrace_trace(struct extrace *x, pid_t pid)
+{
+	struct kinfo_proc *kp;
+	struct kevent kev, *kevs;
+	size_t j;
+	int i, m, n;
+
+	x->fflags = NOTE_EXEC | NOTE_TRACK;
+	if (x->tree || x->flags & EXTRACE_ENVDIFF || x->exitcb)
+		x->fflags |= NOTE_EXIT;
+	if (x->tree && proc_root(x, pid, 0) == -1)
+		return -1;
+	if (x->flags & EXTRACE_REPLAY)
+		return 0;
+
+	if (pid != 1) {
+		EV_SET(&kev, pid, EVFILT_PROC, EV_ADD, x->fflags, 0, 0);
+		return kevent(x->kq, &kev, 1, 0, 0, 0);
+	}
+
+	if (!(kp = kvm_getprocs(x->kd, KERN_PROC_ALL, 0, &n)))
+		return -1;
+	if (!(kevs = calloc(n, sizeof (struct kevent))))
+		return -1;
+	for (i = m = 0; i < n; i++) {
+		if (!kp[i].ki_pid || !kp[i].ki_ppid)
+			continue;
+		if (kp[i].ki_stat == SZOMB)
+			continue;
+		if (x->nxpgrp && pgrp_excluded(x, kp[i].ki_pgid)) {
+			if (proc_root(x, kp[i].ki_pid, 1) == -1) {
+				free(kevs);
+				return -1;
+			}
+			EV_SET(&kevs[m], kp[i].ki_pid, EVFILT_PROC,
+			    EV_ADD | EV_RECEIPT, NOTE_EXIT, 0, 0);
+		} else {
+			EV_SET(&kevs[m], kp[i].ki_pid, EVFILT_PROC,
+			    EV_ADD | EV_RECEIPT, x->fflags, 0, 0);
+		}
+		m++;
+	}
+	/*
+	 * With a receipt for each change, a process that exited since the
+	 * listing fails alone instead of aborting the rest of the batch.
+	 */
+	if ((n = kevent(x->kq, kevs, m, kevs, m, 0)) == -1) {
+		free(kevs);
+		return -1;
+	}
+	for (i = 0; i < n; i++)
+		if (kevs[i].flags & EV_ERROR && kevs[i].data &&
+		    kevs[i].data != ESRCH)
+			x->unattached++;
+	free(kevs);
+	for (j = 0; j < x->nexcl; j++)
+		proc_untrack(x, x->excl[j]);
+	return 0;
+}
+
+/*
+ * Only report events matching the filter expression expr; see
+ * extrace(1) for the syntax.  On error, returns -1 and sets *errstr.
+ * Must be called before extrace_trace().
+ */
+int
+extrace_filter(struct extrace *x, const char *expr, const char **errstr)
+{
+	if (filter_compile(x, &x->filter, expr, errstr) == -1)
+		return -1;
+	if (x->filter.stages & 1 << S_TREE)
+		x->tree = 1;
+	return 0;
+}
+
+static void
+matchers_update(struct extrace *x)
+{
+	struct extrace_filter *f;
+
+	x->mstages = 0;
+	for (f = x->matchers; f; f = f->next)
+		x->mstages |= f->stages;
+}
+
+/*
+ * Compile expr for extrace_match(); the fields it uses are read for
+ * every event from now on.  On error, returns NULL and sets *errstr.
+ */
+struct extrace_filter *
+extrace_filter_new(struct extrace *x, const char *expr, const char **errstr)
+{
+	struct extrace_filter *f;
+
+	if (!(f = calloc(1, sizeof *f))) {
+		*errstr = "out of memory";
+		return 0;
+	}
+	if (filter_compile(x, f, expr, errstr) == -1) {
+		free(f);
+		return 0;
+	}
+	f->next = x->matchers;
+	x->matchers = f;
+	matchers_update(x);
+	return f;
+}
+
+/* does the event being delivered match f?  Only valid in the callback.  */
+int
+extrace_match(struct extrace *x, struct extrace_filter *f)
+{
+	if (!x->curfv || !f->n)
+		return 1;
+	return filter_eval(x, f, x->curfv) == 1;
+}
+
+void
+extrace_filter_free(struct extrace *x, struct extrace_filter *f)
+{
+	struct extrace_filter **fp;
+
+	if (!f)
+		return;
+	for (fp = &x->matchers; *fp && *fp != f; fp = &(*fp)->next)
+		;
+	if (*fp)
+		*fp = f->next;
+	matchers_update(x);
+	filter_free(f);
+	free(f);
+}
+
+/* tag events with a string containing pattern.  */
+int
+extrace_tag(struct extrace *x, const char *tag, const char *pattern)
+{
+	const unsigned char *p = (const unsigned char *)pattern;
+	uint32_t st = 0, n;
+	void *v;
+
+	if (!*p) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (x->nacs + strlen(pattern) + 1 >= AC_MAXSTATES) {
+		errno = E2BIG;
+		return -1;
+	}
+	if (x->npats == x->patcap) {
+		/* grown one at a time, so each is kept on failure.  */
+		n = x->patcap ? 2*x->patcap : 256;
+		if (!(v = realloc(x->pattag, n * sizeof *x->pattag)))
+			return -1;
+		x->pattag = v;
+		if (!(v = realloc(x->tagid, n * sizeof *x->tagid)))
+			return -1;
+		x->tagid = v;
+		if (!(v = realloc(x->tagseen, n * sizeof *x->tagseen)))
+			return -1;
+		x->tagseen = v;
+		if (!(v = realloc(x->tagv, (n + 1) * sizeof *x->tagv)))
+			return -1;
+		x->tagv = v;
+		x->patcap = n;
+	}
+
+	if (!x->nacs) {
+		ac_state(x, 0, 0);  /* the root */
+		if (!x->nacs)
+			return -1;
+	}
+	for (; *p; p++) {
+		if (!(n = ac_goto(x, st, *p))) {
+			if (!(n = ac_state(x, st, *p)))
+				return -1;
+			if (ac_edge(x, st, *p, n) == -1) {
+				x->nacs--;
+				return -1;
+			}
+		}
+		st = n;
+	}
+	if (x->acs[st].pat)
+		return 0;  /* duplicate, the first tag wins */
+	if (!(x->pattag[x->npats] = strdup(tag)))
+		return -1;
+	x->tagseen[x->npats] = 0;
+	x->acs[st].pat = ++x->npats;
+	x->acbuilt = 0;
+	return 0;
+}
+
+static void
+handle_kevent(struct extrace *x, struct kevent *ke)
+{
+	struct proc *p;
+
+	if (!(x->flags & EXTRACE_REPLAY))
+		x->evtime = now_ns();
+	if (ke->fflags & NOTE_CHILD) {
+		/* data is the parent.  */
+		if (x->tree)
+			proc_fork(x, ke->ident, ke->data);
+		if (x->forkcb && (!x->tree ||
+		    ((p = proc_get(x, ke->ident, 0)) && !p->excluded)))
+			x->forkcb(ke->ident, ke->data, x->evtime, x->forkarg);
+	}
+	if (ke->fflags & NOTE_EXEC)
+		handle_msg(x, ke->ident);
+	if (ke->fflags & NOTE_EXIT) {
+		/* data is the wait status.  */
+		if (x->exitcb && (!x->tree ||
+		    ((p = proc_get(x, ke->ident, 0)) && !p->excluded)))
+			x->exitcb(ke->ident, ke->data, x->evtime, x->exitarg);
+		proc_exit(x, ke->ident);
+	}
+}
+
+int
+extrace_fd(struct extrace *x)
+{
+	return x->kq;
+}
+
+/* handle one batch of events, waiting up to timeout ms (-1: forever).  */
+int
+extrace_dispatch(struct extrace *x, int timeout)
+{
+	struct kevent kev[BATCH];
+	struct timespec ts;
+	unsigned long events = x->events;
+	int i, n;
+
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = timeout % 1000 * 1000000;
+	if (x->npats && !x->acbuilt && ac_build(x) == -1)
+		return -1;
+	if ((n = kevent(x->kq, 0, 0, kev, BATCH, timeout < 0 ? 0 : &ts)) == -1)
+		return errno == EINTR ? 0 : -1;
+	for (i = 0; i < n; i++) {
+		if (kev[i].filter != EVFILT_PROC)
+			continue;
+		handle_kevent(x, &kev[i]);
+		if (x->cap)
+			cap_event(x, &kev[i]);
+	}
+	/* an allocation failed, the batch was handled as far as possible.  */
+	if (x->error) {
+		errno = x->error;
+		x->error = 0;
+		return -1;
+	}
+	return x->events - events;
+}
+
+/*
+ * Write the kernel events and everything read for them to f, so that
+ * extrace_replay() can run them again without a kernel.
+ */
+int
+extrace_record(struct extrace *x, FILE *f)
+{
+	if (fwrite(CAP_MAGIC, 1, 8, f) != 8)
+		return -1;
+	x->cap = f;
+	return 0;
+}
+
+/*
+ * Run the events of a capture through a tracer opened with
+ * EXTRACE_REPLAY, as fast as possible.  Fields that were not read
+ * when capturing are unknown.  Returns the number of events delivered.
+ */
+int
+extrace_replay(struct extrace *x, FILE *f)
+{
+	struct buf in = { 0 };
+	struct rcur c;
+	struct rproc *r;
+	struct kevent ke;
+	unsigned long events = x->events;
+	size_t n;
+	int i, ret = -1;
+
+	do {
+		if (buf_grow(&in, 65536) == -1)
+			goto out;
+		in.len += (n = fread(in.s + in.len, 1, in.cap - in.len, f));
+	} while (n);
+	if (ferror(f))
+		goto out;
+	if (in.len < 8 || memcmp(in.s, CAP_MAGIC, 8) != 0) {
+		errno = EINVAL;
+		goto out;
+	}
+	if (!(x->rtab = calloc(PROC_BUCKETS, sizeof *x->rtab)))
+		goto out;
+	if (x->npats && !x->acbuilt && ac_build(x) == -1)
+		goto out;
+
+	c.p = in.s + 8;
+	c.end = in.s + in.len;
+	c.bad = 0;
+	while (c.p < c.end && !c.bad && !x->error)
+		if (rd_record(x, &c, &ke) && !c.bad)
+			handle_kevent(x, &ke);
+	if (x->error) {
+		errno = x->error;
+		x->error = 0;
+	} else if (c.bad) {
+		errno = EINVAL;
+	} else
+		ret = x->events - events;
+
+out:
+	if (x->rtab)
+		for (i = 0; i < PROC_BUCKETS; i++)
+			while ((r = x->rtab[i])) {
+				x->rtab[i] = r->next;
+				free(r->argv.s);
+				free(r->envp.s);
+				free(r);
+			}
+	free(x->rtab);
+	x->rtab = 0;
+	free(in.s);
+	return ret;
+}
+
+/* the parent of pid, from the table of traced processes if known.  */
+static pid_t
+proc_parent(struct extrace *x, pid_t pid)
+{
+	struct kinfo_proc *kp;
+	struct proc *p;
+
+	if ((p = proc_get(x, pid, 0)) && p->ppid > 0)
+		return p->ppid;
+	return (kp = src_kinfo(x, pid)) ? kp->ki_ppid : -1;
+}
+
+/* depth of a process with parent ppid below root, or -1.  */
+int
+extrace_depth(struct extrace *x, pid_t pid, pid_t ppid, pid_t root)
+{
+	int d;
+
+	if (pid == root)
+		return 0;
+	for (d = 1; ppid != root; d++) {
+		if (ppid <= 1)
+			return -1;
+		if ((ppid = proc_parent(x, ppid)) < 0)
+			return -1;
+	}
+	return d;
+}
+
+/*
+ * Store parent ppid and its ancestors up to init in v, at most n of
+ * them.  Returns the number stored, fewer if an ancestor is gone.  The
+ * depth of the process below v[i] is i + 1.
+ */
+int
+extrace_ancestors(struct extrace *x, pid_t ppid, pid_t *v, int n)
+{
+	int i;
+
+	for (i = 0; i < n && ppid > 0; i++) {
+		v[i] = ppid;
+		if (ppid == 1)
+			return i + 1;
+		ppid = proc_parent(x, ppid);
+	}
+	return i;
+}
+
+void
+extrace_stats(struct extrace *x, struct extrace_stats *st)
+{
+	st->events = x->events;
+	st->procs = x->nenvprocs;
+	st->envsets = x->nenvsets;
+	st->envbytes = x->envbytes;
+	st->envbytes_max = x->envbytes_max;
+	st->envbytes_limit = ENV_BYTES;
+	st->envsets_dropped = x->envsets_dropped;
+	st->filtered = x->filtered;
+	st->tag_patterns = x->npats;
+	st->tag_states = x->nacs;
+	st->tag_bytes = x->tag_bytes;
+	st->tag_ns = x->tag_ns;
+	st->tagged = x->tagged;
+	st->suppressed = x->suppressed;
+	st->sampled = x->sampled;
+	st->races = x->races;
+	st->unattached = x->unattached;
+}
+
+/* copy the histogram of the time spent in stage.  */
+void
+extrace_timing(struct extrace *x, int stage, struct extrace_hist *h)
+{
+	if (stage >= 0 && stage < EXTRACE_T_MAX)
+		*h = x->times[stage];
+	else
+		memset(h, 0, sizeof *h);
+}
+
+void
+extrace_close(struct extrace *x)
+{
+	struct bucket *b;
+	struct proc *p;
+	size_t i, j;
+
+	filter_free(&x->filter);
+	while (x->matchers)
+		extrace_filter_free(x, x->matchers);
+	free(x->jbuf.s);
+	for (i = 0; i < x->npats; i++)
+		free(x->pattag[i]);
+	free(x->pattag);
+	free(x->tagid);
+	free(x->tagseen);
+	free(x->tagv);
+	free(x->acs);
+	free(x->acedges);
+	free(x->excl);
+	free(x->xpgrp);
+	for (i = 0; i < x->nlimits; i++)
+		for (j = 0; j < LIMIT_BUCKETS; j++)
+			while ((b = x->limits[i].tab[j])) {
+				x->limits[i].tab[j] = b->next;
+				free(b);
+			}
+	free(x->limits);
+	for (i = 0; i < PROC_BUCKETS; i++)
+		while ((p = x->ptab[i]))
+			proc_exit(x, p->pid);
+	if (x->kd)
+		kvm_close(x->kd);
+	free(x->cbuf.s);
+	close(x->kq);
+	free(x->abuf.s);
+	free(x->ubuf.s);
+	free(x->cur);
+	free(x->set);
+	free(x->unset);
+	free(x);
+}
@@ -0,0 +1,572 @@
+/*
+ * The FreeBSD kernel interfaces extrace uses, played from a script so
+ * that extrace builds and traces on any system.  The script named by
+ * $EXTRACE_SCRIPT has the records of mkcap (see there and script.c):
+ *
+ *	K pid ppid pgid uid ruid gid jid comm	process, its kinfo
+ *	A pid arg...				argv
+ *	V pid var...				environment
+ *	P pid path				executable
+ *	C pid cwd
+ *	E pid events data time			kernel event
+ *	X pid					attaching fails
+ *
+ * A lower case type with only the pid makes that lookup fail, k makes
+ * the process gone.  X pid makes EV_ADD for pid fail with ESRCH, as if
+ * it exited after being listed.  The records before the first E are the
+ * processes running when tracing starts; the records after an event
+ * take effect when the event is read.  E events are only delivered for
+ * processes traced for them: attached with EV_ADD, or children of a
+ * process attached with NOTE_TRACK; time is ignored.
+ *
+ * A kqueue is a pipe, readable while its events are pending.  Another
+ * kqueue, with signals and descriptors on it, sees EVFILT_READ on a
+ * kqueue with events pending; at the end of the script, it sees SIGCHLD
+ * once a child exited if that is watched, else SIGINT.  Without a
+ * script there are no processes.
+ */
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/sysctl.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <kvm.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "script.h"
+
+#define PROC_BUCKETS 65536
+#define MAXKQ 1024		/* descriptors */
+
+struct sproc {
+	pid_t pid;
+	int alive;
+	int esrch;		/* X: attaching fails */
+	int have;		/* lookups that succeed */
+	struct kinfo_proc ki;
+	char **argv;
+	char **envv;
+	char *path;
+	char *cwd;
+	int kq;			/* traced on, -1 if not */
+	unsigned fflags;
+	struct sproc *next;
+};
+
+#define H_KINFO 1
+#define H_ARGV  2
+#define H_ENV   4
+#define H_PATH  8
+#define H_CWD   16
+
+struct reg {
+	short filter;
+	uintptr_t ident;
+};
+
+struct kq {
+	int used;
+	int wfd;		/* write end of the pipe */
+	int ready;		/* a byte is in the pipe */
+	struct reg *regs;	/* other than EVFILT_PROC */
+	size_t nregs;
+};
+
+static struct sproc *ptab[PROC_BUCKETS];
+static struct kq kqs[MAXKQ];
+static FILE *script;
+static int loaded;
+static unsigned long lineno;
+static char line[65536];
+static char *f[MAXFIELDS];
+static int nf;			/* fields of the next E record, 0 at the end */
+static struct kinfo_proc *kpbuf;
+static size_t kpcap;
+
+static struct sproc *
+sproc_get(pid_t pid, int create)
+{
+	struct sproc *p;
+
+	for (p = ptab[pid % PROC_BUCKETS]; p; p = p->next)
+		if (p->pid == pid)
+			return p;
+	if (!create)
+		return 0;
+	if (!(p = calloc(1, sizeof *p)))
+		err(1, "calloc");
+	p->pid = pid;
+	p->kq = -1;
+	p->next = ptab[pid % PROC_BUCKETS];
+	ptab[pid % PROC_BUCKETS] = p;
+	return p;
+}
+
+static char *
+xstrdup(const char *s)
+{
+	char *r;
+
+	if (!(r = strdup(s)))
+		err(1, "strdup");
+	return r;
+}
+
+static char **
+strv(char **v, int n)
+{
+	char **r;
+	int i;
+
+	if (!(r = calloc(n + 1, sizeof *r)))
+		err(1, "calloc");
+	for (i = 0; i < n; i++)
+		r[i] = xstrdup(v[i]);
+	return r;
+}
+
+static void
+strv_free(char **v)
+{
+	char **s;
+
+	for (s = v; s && *s; s++)
+		free(*s);
+	free(v);
+}
+
+/* apply records up to the next E, which is left in f.  */
+static void
+advance(void)
+{
+	struct sproc *p;
+	int i;
+
+	while ((nf = script ? script_read(script, line, sizeof line, f,
+	    &lineno) : 0)) {
+		if (*f[0] == 'E') {
+			if (nf != 5)
+				errx(1, "script line %lu: E needs 4 fields",
+				    lineno);
+			return;
+		}
+		p = sproc_get(strtol(f[1], 0, 10), 1);
+		switch (*f[0]) {
+		case 'K':
+			if (nf != 9)
+				errx(1, "script line %lu: K needs 8 fields",
+				    lineno);
+			p->alive = 1;
+			p->have |= H_KINFO;
+			memset(&p->ki, 0, sizeof p->ki);
+			p->ki.ki_pid = p->pid;
+			p->ki.ki_ppid = strtol(f[2], 0, 10);
+			p->ki.ki_pgid = strtol(f[3], 0, 10);
+			p->ki.ki_uid = strtoul(f[4], 0, 10);
+			p->ki.ki_ruid = strtoul(f[5], 0, 10);
+			p->ki.ki_groups[0] = strtoul(f[6], 0, 10);
+			p->ki.ki_jid = strtol(f[7], 0, 10);
+			snprintf(p->ki.ki_comm, sizeof p->ki.ki_comm, "%s",
+			    f[8]);
+			break;
+		case 'A':
+			strv_free(p->argv);
+			p->argv = strv(f + 2, nf - 2);
+			p->have |= H_ARGV;
+			break;
+		case 'V':
+			strv_free(p->envv);
+			p->envv = strv(f + 2, nf - 2);
+			p->have |= H_ENV;
+			break;
+		case 'P':
+		case 'C':
+			if (nf != 3)
+				errx(1, "script line %lu: %s needs 2 fields",
+				    lineno, f[0]);
+			i = *f[0] == 'P' ? H_PATH : H_CWD;
+			free(i == H_PATH ? p->path : p->cwd);
+			*(i == H_PATH ? &p->path : &p->cwd) = xstrdup(f[2]);
+			p->have |= i;
+			break;
+		case 'k': p->alive = 0; p->have &= ~H_KINFO; break;
+		case 'a': p->have &= ~H_ARGV; break;
+		case 'v': p->have &= ~H_ENV; break;
+		case 'p': p->have &= ~H_PATH; break;
+		case 'c': p->have &= ~H_CWD; break;
+		case 'X': p->esrch = 1; break;
+		default:
+			errx(1, "script line %lu: unknown record %s", lineno,
+			    f[0]);
+		}
+	}
+}
+
+static void
+load(void)
+{
+	const char *s;
+
+	if (loaded)
+		return;
+	loaded = 1;
+	if ((s = getenv("EXTRACE_SCRIPT")) && !(script = fopen(s, "r")))
+		err(1, "%s", s);
+	advance();
+}
+
+/* keep a byte in the pipe of kq while it has events.  */
+static void
+kq_sync(int kq)
+{
+	char c = 0;
+	int pending = nf != 0;
+
+	if (pending && !kqs[kq].ready) {
+		if (write(kqs[kq].wfd, &c, 1) != 1)
+			err(1, "write");
+		kqs[kq].ready = 1;
+	} else if (!pending && kqs[kq].ready) {
+		if (read(kq, &c, 1) != 1)
+			err(1, "read");
+		kqs[kq].ready = 0;
+	}
+}
+
+int
+kqueue(void)
+{
+	int fd[2];
+
+	load();
+	if (pipe(fd) == -1)
+		return -1;
+	if (fd[0] >= MAXKQ) {
+		close(fd[0]);
+		close(fd[1]);
+		errno = EMFILE;
+		return -1;
+	}
+	kqs[fd[0]].used = 1;
+	kqs[fd[0]].wfd = fd[1];
+	kq_sync(fd[0]);
+	return fd[0];
+}
+
+/* apply a change, returns 0 or an errno.  */
+static int
+change(int kq, const struct kevent *kev)
+{
+	struct kq *q = &kqs[kq];
+	struct sproc *p;
+	size_t i;
+
+	if (kev->filter != EVFILT_PROC) {
+		for (i = 0; i < q->nregs; i++)
+			if (q->regs[i].filter == kev->filter &&
+			    q->regs[i].ident == kev->ident)
+				break;
+		if (kev->flags & EV_DELETE) {
+			if (i == q->nregs)
+				return ENOENT;
+			q->regs[i] = q->regs[--q->nregs];
+		} else if (i == q->nregs) {
+			if (!(q->regs = realloc(q->regs,
+			    (q->nregs + 1) * sizeof *q->regs)))
+				err(1, "realloc");
+			q->regs[q->nregs].filter = kev->filter;
+			q->regs[q->nregs++].ident = kev->ident;
+		}
+		return 0;
+	}
+
+	p = sproc_get(kev->ident, 0);
+	if (kev->flags & EV_DELETE) {
+		if (!p || p->kq != kq)
+			return ENOENT;
+		p->kq = -1;
+		return 0;
+	}
+	if (!p || !p->alive || p->esrch) {
+		/* a real process outside the script, like a command run.  */
+		if (p || kill(kev->ident, 0) == -1)
+			return ESRCH;
+		p = sproc_get(kev->ident, 1);
+	}
+	p->kq = kq;
+	p->fflags = kev->fflags;
+	return 0;
+}
+
+/*
+ * The next kernel event for kq, one per call so that it is handled
+ * before the records after the next one take effect.
+ */
+static int
+proc_events(int kq, struct kevent *ev)
+{
+	struct sproc *p, *parent;
+	unsigned ff, deliver;
+	pid_t pid;
+	long data;
+	int m = 0;
+
+	while (nf && !m) {
+		pid = strtol(f[1], 0, 10);
+		ff = script_events(f[2]);
+		data = strtol(f[3], 0, 10);
+		p = sproc_get(pid, 1);
+		deliver = 0;
+		if (ff & NOTE_CHILD && (parent = sproc_get(data, 0)) &&
+		    parent->kq == kq && parent->fflags & NOTE_TRACK) {
+			p->kq = kq;
+			p->fflags = parent->fflags;
+			deliver |= NOTE_CHILD;
+		}
+		if (p->kq == kq)
+			deliver |= ff & p->fflags &
+			    (NOTE_EXEC | NOTE_EXIT | NOTE_FORK);
+		if (ff & NOTE_EXIT) {
+			p->alive = 0;
+			p->kq = -1;
+		}
+		if (deliver) {
+			memset(&ev[m], 0, sizeof ev[m]);
+			ev[m].ident = pid;
+			ev[m].filter = EVFILT_PROC;
+			ev[m].fflags = deliver;
+			ev[m].data = data;
+			m++;
+		}
+		advance();
+	}
+	return m;
+}
+
+/* events of a kqueue with signals and descriptors.  */
+static int
+other_events(int kq, struct kevent *ev, int n, const struct timespec *ts)
+{
+	struct kq *q = &kqs[kq];
+	siginfo_t si;
+	size_t i;
+	int sig = 0;
+
+	if (n < 1)
+		return 0;
+	memset(ev, 0, sizeof *ev);
+	for (i = 0; i < q->nregs; i++)
+		if (q->regs[i].filter == EVFILT_READ &&
+		    q->regs[i].ident < MAXKQ && kqs[q->regs[i].ident].used &&
+		    kqs[q->regs[i].ident].ready) {
+			ev->ident = q->regs[i].ident;
+			ev->filter = EVFILT_READ;
+			return 1;
+		}
+	if (nf)
+		return 0;
+	for (i = 0; i < q->nregs; i++)
+		if (q->regs[i].filter == EVFILT_SIGNAL &&
+		    (q->regs[i].ident == SIGCHLD ||
+		    (q->regs[i].ident == SIGINT && !sig)))
+			sig = q->regs[i].ident;
+	if (!sig || (ts && sig != SIGCHLD))
+		return 0;
+	if (sig == SIGCHLD &&
+	    waitid(P_ALL, 0, &si, WEXITED | WNOWAIT) == -1 && errno != ECHILD)
+		return -1;
+	ev->ident = sig;
+	ev->filter = EVFILT_SIGNAL;
+	return 1;
+}
+
+int
+kevent(int kq, const struct kevent *changes, int nchanges,
+    struct kevent *events, int nevents, const struct timespec *timeout)
+{
+	struct kevent *cv;
+	int i, e, m = 0;
+
+	load();
+	if (kq < 0 || kq >= MAXKQ || !kqs[kq].used) {
+		errno = EBADF;
+		return -1;
+	}
+	/* the receipts may be written over the changes.  */
+	if (!(cv = malloc((nchanges + 1) * sizeof *cv)))
+		err(1, "malloc");
+	memcpy(cv, changes, nchanges * sizeof *cv);
+	for (i = 0; i < nchanges; i++) {
+		e = change(kq, &cv[i]);
+		if (!e && !(cv[i].flags & EV_RECEIPT))
+			continue;
+		if (m == nevents) {
+			if (e) {
+				free(cv);
+				errno = e;
+				return -1;
+			}
+			continue;
+		}
+		events[m] = cv[i];
+		events[m].flags = EV_ERROR;
+		events[m++].data = e;
+	}
+	free(cv);
+	if (m || nevents == 0)
+		return m;
+
+	if (kqs[kq].nregs)
+		m = other_events(kq, events, nevents, timeout);
+	else
+		m = proc_events(kq, events);
+	kq_sync(kq);
+	for (i = 0; i < MAXKQ; i++)
+		if (kqs[i].used && i != kq && !kqs[i].nregs)
+			kq_sync(i);
+	return m;
+}
+
+kvm_t *
+kvm_openfiles(const char *execfile, const char *corefile,
+    const char *swapfile, int flags, char *errbuf)
+{
+	static int kd;
+
+	(void)execfile, (void)corefile, (void)swapfile, (void)flags;
+	(void)errbuf;
+	load();
+	return (kvm_t *)&kd;
+}
+
+static void
+kp_add(size_t *n, struct sproc *p)
+{
+	if (*n == kpcap) {
+		kpcap *= 2;
+		if (!(kpbuf = realloc(kpbuf, kpcap * sizeof *kpbuf)))
+			err(1, "realloc");
+	}
+	kpbuf[(*n)++] = p->ki;
+}
+
+struct kinfo_proc *
+kvm_getprocs(kvm_t *kd, int op, int arg, int *cnt)
+{
+	struct sproc *p;
+	size_t i, n = 0;
+
+	(void)kd;
+	*cnt = 0;
+	if (!kpbuf && !(kpbuf = calloc(kpcap = 64, sizeof *kpbuf)))
+		err(1, "calloc");
+	if (op == KERN_PROC_PID) {
+		if (!(p = sproc_get(arg, 0)) || !p->alive ||
+		    !(p->have & H_KINFO)) {
+			errno = ESRCH;
+			return 0;
+		}
+		kp_add(&n, p);
+	} else {
+		for (i = 0; i < PROC_BUCKETS; i++)
+			for (p = ptab[i]; p; p = p->next)
+				if (p->alive && p->have & H_KINFO &&
+				    (op != KERN_PROC_PGRP ||
+				    p->ki.ki_pgid == arg))
+					kp_add(&n, p);
+	}
+	*cnt = n;
+	return kpbuf;
+}
+
+char **
+kvm_getargv(kvm_t *kd, const struct kinfo_proc *kp, int nchr)
+{
+	struct sproc *p = sproc_get(kp->ki_pid, 0);
+
+	(void)kd, (void)nchr;
+	return p && p->alive && p->have & H_ARGV ? p->argv : 0;
+}
+
+char **
+kvm_getenvv(kvm_t *kd, const struct kinfo_proc *kp, int nchr)
+{
+	struct sproc *p = sproc_get(kp->ki_pid, 0);
+
+	(void)kd, (void)nchr;
+	return p && p->alive && p->have & H_ENV ? p->envv : 0;
+}
+
+char *
+kvm_geterr(kvm_t *kd)
+{
+	(void)kd;
+	return (char *)"no such process";
+}
+
+int
+kvm_close(kvm_t *kd)
+{
+	(void)kd;
+	return 0;
+}
+
+static int
+copyout(const char *s, void *old, size_t *oldlen)
+{
+	size_t len = strlen(s) + 1;
+
+	if (old && *oldlen < len) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if (old)
+		memcpy(old, s, len);
+	*oldlen = len;
+	return 0;
+}
+
+int
+sysctl(const int *name, unsigned namelen, void *old, size_t *oldlen,
+    const void *new, size_t newlen)
+{
+	struct kinfo_file *kf = old;
+	struct sproc *p;
+
+	(void)new, (void)newlen;
+	if (namelen != 4 || name[0] != CTL_KERN || name[1] != KERN_PROC) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (!(p = sproc_get(name[3], 0)) || !p->alive) {
+		errno = ESRCH;
+		return -1;
+	}
+	switch (name[2]) {
+	case KERN_PROC_PATHNAME:
+		if (!(p->have & H_PATH))
+			break;
+		return copyout(p->path, old, oldlen);
+	case KERN_PROC_CWD:
+		if (!(p->have & H_CWD) || !kf || *oldlen < sizeof *kf)
+			break;
+		memset(kf, 0, sizeof *kf);
+		kf->kf_structsize = sizeof *kf;
+		snprintf(kf->kf_path, sizeof kf->kf_path, "%s", p->cwd);
+		return 0;
+	case KERN_PROC_FILEDESC:
+		*oldlen = 0;	/* no open files */
+		return 0;
+	}
+	errno = ESRCH;
+	return -1;
+}
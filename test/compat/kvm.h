@@ -0,0 +1,16 @@
+/* stub of FreeBSD <kvm.h>, see compat.c */
+#ifndef COMPAT_KVM_H
+#define COMPAT_KVM_H
+
+#include <sys/user.h>
+
+typedef struct __kvm kvm_t;
+
+kvm_t *kvm_openfiles(const char *, const char *, const char *, int, char *);
+struct kinfo_proc *kvm_getprocs(kvm_t *, int, int, int *);
+char **kvm_getargv(kvm_t *, const struct kinfo_proc *, int);
+char **kvm_getenvv(kvm_t *, const struct kinfo_proc *, int);
+char *kvm_geterr(kvm_t *);
+int kvm_close(kvm_t *);
+
+#endif
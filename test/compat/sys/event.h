@@ -0,0 +1,55 @@
+/* stub of FreeBSD <sys/event.h>, see compat.c */
+#ifndef COMPAT_SYS_EVENT_H
+#define COMPAT_SYS_EVENT_H
+
+#include <stdint.h>
+#include <time.h>
+
+struct kevent {
+	uintptr_t ident;
+	short filter;
+	unsigned short flags;
+	unsigned int fflags;
+	int64_t data;
+	void *udata;
+	uint64_t ext[4];
+};
+
+#define EVFILT_READ   (-1)
+#define EVFILT_WRITE  (-2)
+#define EVFILT_PROC   (-5)
+#define EVFILT_SIGNAL (-6)
+#define EVFILT_TIMER  (-7)
+
+#define EV_ADD     0x0001
+#define EV_DELETE  0x0002
+#define EV_ENABLE  0x0004
+#define EV_DISABLE 0x0008
+#define EV_ONESHOT 0x0010
+#define EV_CLEAR   0x0020
+#define EV_RECEIPT 0x0040
+#define EV_ERROR   0x4000
+#define EV_EOF     0x8000
+
+#define NOTE_EXIT     0x80000000
+#define NOTE_FORK     0x40000000
+#define NOTE_EXEC     0x20000000
+#define NOTE_TRACK    0x00000001
+#define NOTE_TRACKERR 0x00000002
+#define NOTE_CHILD    0x00000004
+
+#define EV_SET(kevp_, a, b, c, d, e, f) do {	\
+	struct kevent *kevp = (kevp_);		\
+	kevp->ident = (a);			\
+	kevp->filter = (b);			\
+	kevp->flags = (c);			\
+	kevp->fflags = (d);			\
+	kevp->data = (e);			\
+	kevp->udata = (f);			\
+} while (0)
+
+int kqueue(void);
+int kevent(int, const struct kevent *, int, struct kevent *, int,
+    const struct timespec *);
+
+#endif
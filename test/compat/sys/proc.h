@@ -0,0 +1,7 @@
+/* stub of FreeBSD <sys/proc.h>, see compat.c */
+#ifndef COMPAT_SYS_PROC_H
+#define COMPAT_SYS_PROC_H
+
+#define SZOMB 5
+
+#endif
@@ -0,0 +1,18 @@
+/* stub of FreeBSD <sys/sysctl.h>, see compat.c */
+#ifndef COMPAT_SYS_SYSCTL_H
+#define COMPAT_SYS_SYSCTL_H
+
+#include <stddef.h>
+
+#define CTL_KERN 1
+#define KERN_PROC 14
+#define KERN_PROC_ALL 0
+#define KERN_PROC_PID 1
+#define KERN_PROC_PGRP 2
+#define KERN_PROC_PATHNAME 12
+#define KERN_PROC_FILEDESC 33
+#define KERN_PROC_CWD 42
+
+int sysctl(const int *, unsigned, void *, size_t *, const void *, size_t);
+
+#endif
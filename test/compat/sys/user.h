@@ -0,0 +1,39 @@
+/* stub of FreeBSD <sys/user.h>, only the fields extrace reads */
+#ifndef COMPAT_SYS_USER_H
+#define COMPAT_SYS_USER_H
+
+#include <sys/types.h>
+#include <limits.h>
+#include <stdint.h>
+
+#define COMMLEN 19
+#define KI_NGROUPS 16
+
+struct kinfo_proc {
+	pid_t ki_pid;
+	pid_t ki_ppid;
+	pid_t ki_pgid;
+	uid_t ki_uid;
+	uid_t ki_ruid;
+	gid_t ki_groups[KI_NGROUPS];
+	int ki_jid;
+	char ki_stat;
+	char ki_comm[COMMLEN + 1];
+};
+
+#define KF_TYPE_PIPE 3
+
+struct kinfo_file {
+	int kf_structsize;
+	int kf_type;
+	int kf_fd;
+	union {
+		struct {
+			uint64_t kf_pipe_addr;
+			uint64_t kf_pipe_peer;
+		} kf_pipe;
+	} kf_un;
+	char kf_path[PATH_MAX];
+};
+
+#endif
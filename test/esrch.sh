@@ -0,0 +1,13 @@
+#!/bin/sh
+# Every process exits between being listed and being attached to, so
+# none of them nor the programs they run later are traced.
+awk 'BEGIN {
+	print "K 1 0 1 0 0 0 0 init"
+	for (pid = 1000; pid < 2000; pid++)
+		printf "K %d 1 %d 0 0 0 0 sh\nX %d\n", pid, pid, pid
+	print "E 3000 child 1500 0"
+	print "K 3000 1500 1500 0 0 0 0 true"
+	print "A 3000 true"
+	print "E 3000 exec 0 0"
+	print "E 3000 exit 0 0"
+}'
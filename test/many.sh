@@ -0,0 +1,13 @@
+#!/bin/sh
+# 100000 processes running when tracing starts, then one of them runs
+# a program.
+awk 'BEGIN {
+	print "K 1 0 1 0 0 0 0 init"
+	for (pid = 1000; pid < 101000; pid++)
+		printf "K %d 1 %d 0 0 0 0 sleep\n", pid, pid
+	print "E 200000 child 50999 0"
+	print "K 200000 50999 50999 0 0 0 0 true"
+	print "A 200000 true"
+	print "E 200000 exec 0 0"
+	print "E 200000 exit 0 0"
+}'
@@ -0,0 +1,98 @@
+/*
+ * mkcap - write an extrace capture, as saved by extrace -W, from a
+ * readable description on standard input, one record per line:
+ *
+ *	K pid ppid pgid uid ruid gid jid comm	kinfo
+ *	A pid arg...				argv
+ *	V pid var...				environment
+ *	P pid path				executable
+ *	C pid cwd
+ *	E pid events data time			kernel event
+ *
+ * A lower case type with only the pid records a failed lookup.  events
+ * is a comma separated list of exec, exit, fork and child, data the
+ * parent for child or the wait status for exit, and time is in us.
+ * See script.c for the syntax of fields.
+ */
+#include <sys/event.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "script.h"
+
+static void
+put_var(uint64_t v)
+{
+	unsigned char c;
+
+	do {
+		c = v & 0x7f;
+		if ((v >>= 7))
+			c |= 0x80;
+		putchar(c);
+	} while (v);
+}
+
+static void
+put_str(const char *s)
+{
+	fwrite(s, 1, strlen(s) + 1, stdout);
+}
+
+int
+main(void)
+{
+	char line[65536], *f[MAXFIELDS];
+	unsigned long lineno = 0;
+	unsigned ff;
+	int n, i;
+
+	fwrite("EXTRACAP", 1, 8, stdout);
+	while ((n = script_read(stdin, line, sizeof line, f, &lineno))) {
+		putchar(*f[0]);
+		put_var(strtoul(f[1], 0, 10));
+		switch (*f[0]) {
+		case 'K':
+			if (n != 9)
+				errx(1, "line %lu: K needs 8 fields", lineno);
+			for (i = 2; i < 8; i++)
+				put_var(strtoul(f[i], 0, 10));
+			put_str(f[8]);
+			break;
+		case 'A':
+		case 'V':
+			put_var(n - 2);
+			for (i = 2; i < n; i++)
+				put_str(f[i]);
+			break;
+		case 'P':
+		case 'C':
+			if (n != 3)
+				errx(1, "line %lu: %s needs 2 fields", lineno, f[0]);
+			put_str(f[2]);
+			break;
+		case 'E':
+			if (n != 5)
+				errx(1, "line %lu: E needs 4 fields", lineno);
+			ff = script_events(f[2]);
+			put_var(ff);
+			put_var((uint32_t)strtol(f[3], 0, 10));
+			put_var(strtoull(f[4], 0, 10) * 1000);
+			break;
+		case 'k': case 'a': case 'v': case 'p': case 'c':
+			if (n != 2)
+				errx(1, "line %lu: failed lookup has only a pid",
+				    lineno);
+			break;
+		default:
+			errx(1, "line %lu: unknown record %s", lineno, f[0]);
+		}
+	}
+	if (fflush(stdout) == EOF)
+		err(1, "write");
+	return 0;
+}
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Run extrace for each case in the file cases with its options, and
+# compare the output and the report on standard error, without the
+# timings, with NAME.out.  A case replays the capture made from CAP.txt
+# by mkcap, or with !CAP traces the kernel played from CAP.txt by
+# compat.c.  CAP.txt is made by CAP.sh where there is one.  Options
+# after a | are for a second extrace reading the output of the first.
+cd "$(dirname "$0")" || exit 1
+status=0
+while read -r name cap opts; do
+	case $name in
+	''|'#'*) continue ;;
+	esac
+	src=${cap#!}
+	pipe=
+	case $opts in
+	*'|'*) pipe=${opts#*|} opts=${opts%%|*} ;;
+	esac
+	[ -f $src.sh ] && [ ! -f $src.txt ] && sh $src.sh >$src.txt
+	if [ "$src" = "$cap" ]; then
+		./mkcap <$cap.txt >$cap.cap || exit 1
+		if [ -n "$pipe" ]; then
+			./extrace -R $cap.cap $opts 2>$name.err |
+			    ./extrace $pipe >$name.got 2>>$name.err
+		else
+			./extrace -R $cap.cap $opts >$name.got 2>$name.err
+		fi
+	else
+		EXTRACE_SCRIPT=$src.txt ./extrace $opts >$name.got 2>$name.err
+	fi
+	grep -v -e ' n=' -e ' execs in ' -e 'ns/byte' $name.err >>$name.got
+	rm -f $name.err
+	if cmp -s $name.out $name.got; then
+		rm -f $name.got
+	else
+		echo "FAIL: $name: extrace $opts${pipe:+| extrace$pipe} on $cap"
+		diff -u $name.out $name.got
+		status=1
+	fi
+done <cases
+[ $status = 0 ] && echo "all cases passed"
+exit $status
@@ -0,0 +1,92 @@
+/*
+ * The text records read by mkcap and by the scripted kernel of compat.c,
+ * one per line: a record type and its fields, separated by white space.
+ * \s, \t, \n, \\ and \NNN (octal) stand for those bytes in a field, a
+ * field of only \e is empty.  Empty lines and lines starting with # are
+ * ignored.
+ */
+#include <sys/event.h>
+
+#include <err.h>
+#include <string.h>
+
+#include "script.h"
+
+/* undo the escapes of field s in place.  */
+static char *
+unescape(char *s)
+{
+	char *r = s, *w = s;
+	int i;
+
+	if (strcmp(s, "\\e") == 0) {
+		*s = 0;
+		return s;
+	}
+	while (*r) {
+		if (*r != '\\') {
+			*w++ = *r++;
+			continue;
+		}
+		switch (*++r) {
+		case 's': *w++ = ' '; r++; break;
+		case 't': *w++ = '\t'; r++; break;
+		case 'n': *w++ = '\n'; r++; break;
+		case '\\': *w++ = '\\'; r++; break;
+		default:
+			for (i = 0, *w = 0; i < 3 && *r >= '0' && *r <= '7'; i++)
+				*w = *w * 8 + *r++ - '0';
+			if (i != 3)
+				errx(1, "bad escape in %s", s);
+			w++;
+		}
+	}
+	*w = 0;
+	return s;
+}
+
+/*
+ * Read the next record from fp into line of size len and split it into
+ * f, at most MAXFIELDS.  Returns the number of fields, or 0 at the end.
+ */
+int
+script_read(FILE *fp, char *line, size_t len, char **f, unsigned long *lineno)
+{
+	int n, i;
+
+	while (fgets(line, len, fp)) {
+		++*lineno;
+		for (n = 0, f[0] = strtok(line, " \t\n");
+		    f[n] && n < MAXFIELDS - 1; )
+			f[++n] = strtok(0, " \t\n");
+		if (n == 0 || *f[0] == '#')
+			continue;
+		if (strlen(f[0]) != 1 || n < 2)
+			errx(1, "line %lu: bad record", *lineno);
+		for (i = 1; i < n; i++)
+			unescape(f[i]);
+		return n;
+	}
+	return 0;
+}
+
+/* the NOTE_ flags of a comma separated list of event names.  */
+unsigned
+script_events(char *s)
+{
+	unsigned ff = 0;
+	char *e;
+
+	for (e = strtok(s, ","); e; e = strtok(0, ","))
+		if (strcmp(e, "exec") == 0)
+			ff |= NOTE_EXEC;
+		else if (strcmp(e, "exit") == 0)
+			ff |= NOTE_EXIT;
+		else if (strcmp(e, "fork") == 0)
+			ff |= NOTE_FORK;
+		else if (strcmp(e, "child") == 0)
+			ff |= NOTE_CHILD;
+		else
+			errx(1, "unknown event: %s", e);
+	return ff;
+}
@@ -0,0 +1,12 @@
+/* script.h - the text records of mkcap(1) and of the kernel in compat.c */
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <stdio.h>
+
+#define MAXFIELDS 256
+
+int script_read(FILE *, char *, size_t, char **, unsigned long *);
+unsigned script_events(char *);
+
+#endif